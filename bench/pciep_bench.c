@@ -0,0 +1,676 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * pciep_bench - throughput and latency benchmark for /dev/pciepN
+ *
+ * Sweeps transfer sizes over the read (host to endpoint) and write
+ * (endpoint to host) paths and reports MB/s, latency percentiles and CPU
+ * usage per size. The host side has to feed and drain the endpoint while
+ * the benchmark runs.
+ *
+ * The stress mode instead hammers one file from several threads with a
+ * random mix of transfers, ioctls and seeks. Combined with the fail_*
+ * fault injection attributes under debugfs it checks that every call
+ * comes back, with success or one of the errors a lossy link may cause.
+ *
+ * Copyright (C) 2021 Xilinx, Inc.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "../xlnx_pcie_platform_ioctl.h"
+
+#define MAX_DEPTH	32
+#define MAX_THREADS	64
+
+enum bench_mode {
+	MODE_SYNC,
+	MODE_ASYNC,
+	MODE_MMAP,
+	MODE_STRESS,
+};
+
+static const char * const mode_names[] = {
+	[MODE_SYNC]  = "sync",
+	[MODE_ASYNC] = "async",
+	[MODE_MMAP]  = "mmap",
+	[MODE_STRESS] = "stress",
+};
+
+enum stress_op {
+	OP_READ,
+	OP_WRITE,
+	OP_CONFIG,
+	OP_SEEK,
+	OP_CANCEL,
+	NUM_OPS,
+};
+
+static const char * const op_names[] = {
+	[OP_READ]   = "read",
+	[OP_WRITE]  = "write",
+	[OP_CONFIG] = "config",
+	[OP_SEEK]   = "lseek",
+	[OP_CANCEL] = "cancel",
+};
+
+/* what a call may fail with when transfers are lost, delayed or starved */
+enum stress_status {
+	ST_OK,
+	ST_TIMEDOUT,
+	ST_CANCELED,
+	ST_NOMEM,
+	ST_AGAIN,
+	ST_OTHER,
+	NUM_STATUS,
+};
+
+static const char * const status_names[] = {
+	[ST_OK]       = "ok",
+	[ST_TIMEDOUT] = "timedout",
+	[ST_CANCELED] = "canceled",
+	[ST_NOMEM]    = "nomem",
+	[ST_AGAIN]    = "again",
+	[ST_OTHER]    = "other",
+};
+
+struct bench_opts {
+	const char *device;
+	enum bench_mode mode;
+	bool do_read;
+	bool do_write;
+	size_t min_size;
+	size_t max_size;
+	unsigned int depth;
+	unsigned int iterations;
+	unsigned int threads;
+	unsigned int timeout_ms;
+};
+
+struct bench_result {
+	double *lat_us;
+	unsigned int count;
+	size_t bytes;
+	double elapsed;
+	int error;
+	unsigned long calls[NUM_OPS][NUM_STATUS];
+};
+
+struct bench_job {
+	const struct bench_opts *opts;
+	bool write;
+	size_t size;
+	pthread_t thread;
+	struct bench_result result;
+	int fd;
+	unsigned int seed;
+};
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double cpu_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec * 1e6 + ru.ru_utime.tv_usec +
+	       ru.ru_stime.tv_sec * 1e6 + ru.ru_stime.tv_usec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct bench_result *r, double p)
+{
+	unsigned int i;
+
+	if (!r->count)
+		return 0;
+	i = (unsigned int)(p * (r->count - 1) + 0.5);
+	return r->lat_us[i];
+}
+
+/* read()/write() on a user buffer, one blocking transfer at a time */
+static int run_sync(int fd, struct bench_job *job, char *data)
+{
+	const struct bench_opts *o = job->opts;
+	struct bench_result *r = &job->result;
+	unsigned int i;
+	ssize_t ret;
+	double t;
+
+	for (i = 0; i < o->iterations; i++) {
+		t = now_us();
+		if (job->write)
+			ret = write(fd, data, job->size);
+		else
+			ret = read(fd, data, job->size);
+		if (ret)
+			return ret < 0 ? -errno : -EIO;
+		r->lat_us[r->count++] = now_us() - t;
+		r->bytes += job->size;
+	}
+
+	return 0;
+}
+
+/*
+ * O_NONBLOCK read()/write() driven by poll(). A read arms a buffer and
+ * copies it out once POLLIN says it is done, a write queues a buffer and
+ * goes on as long as POLLOUT reports a free one.
+ */
+static int run_async(int fd, struct bench_job *job, char *data)
+{
+	const struct bench_opts *o = job->opts;
+	struct bench_result *r = &job->result;
+	struct pollfd pfd = { .fd = fd };
+	unsigned int i;
+	ssize_t ret;
+	double t;
+
+	pfd.events = job->write ? POLLOUT : POLLIN;
+	for (i = 0; i < o->iterations; i++) {
+		t = now_us();
+		for (;;) {
+			if (job->write)
+				ret = write(fd, data, job->size);
+			else
+				ret = read(fd, data, job->size);
+			if (!ret)
+				break;
+			if (ret > 0 || errno != EAGAIN)
+				return ret < 0 ? -errno : -EIO;
+			if (poll(&pfd, 1, -1) < 0)
+				return -errno;
+		}
+		r->lat_us[r->count++] = now_us() - t;
+		r->bytes += job->size;
+	}
+
+	return 0;
+}
+
+/* QUEUE_BUF/DEQUEUE_BUF on mmap()ed pool buffers, depth of them in flight */
+static int run_mmap(int fd, struct bench_job *job)
+{
+	const struct bench_opts *o = job->opts;
+	struct bench_result *r = &job->result;
+	double queued_at[MAX_DEPTH];
+	void *map[MAX_DEPTH] = { };
+	size_t len[MAX_DEPTH] = { };
+	unsigned int i, depth = o->depth, done = 0, queued = 0;
+	struct buffer_desc desc;
+	int ret = 0;
+
+	for (i = 0; i < depth; i++) {
+		memset(&desc, 0, sizeof(desc));
+		desc.type = job->write ? BUF_TYPE_WRITE : BUF_TYPE_READ;
+		desc.index = i;
+		if (ioctl(fd, QUERY_BUF, &desc)) {
+			ret = -errno;
+			goto unmap;
+		}
+		if (desc.length < job->size) {
+			ret = -EINVAL;
+			goto unmap;
+		}
+		len[i] = desc.length;
+		map[i] = mmap(NULL, len[i], PROT_READ | PROT_WRITE, MAP_SHARED,
+			      fd, desc.offset);
+		if (map[i] == MAP_FAILED) {
+			map[i] = NULL;
+			ret = -errno;
+			goto unmap;
+		}
+	}
+
+	while (done < o->iterations) {
+		while (queued < o->iterations && queued - done < depth) {
+			memset(&desc, 0, sizeof(desc));
+			desc.type = job->write ? BUF_TYPE_WRITE : BUF_TYPE_READ;
+			desc.index = queued % depth;
+			desc.bytesused = job->size;
+			queued_at[desc.index] = now_us();
+			if (ioctl(fd, QUEUE_BUF, &desc)) {
+				ret = -errno;
+				goto unmap;
+			}
+			queued++;
+		}
+
+		memset(&desc, 0, sizeof(desc));
+		desc.type = job->write ? BUF_TYPE_WRITE : BUF_TYPE_READ;
+		if (ioctl(fd, DEQUEUE_BUF, &desc)) {
+			ret = -errno;
+			goto unmap;
+		}
+		r->lat_us[r->count++] = now_us() - queued_at[desc.index];
+		r->bytes += desc.bytesused;
+		done++;
+	}
+
+unmap:
+	/* closing the device hands whatever is still queued back */
+	for (i = 0; i < depth; i++)
+		if (map[i])
+			munmap(map[i], len[i]);
+	return ret;
+}
+
+static enum stress_status stress_status(int err)
+{
+	switch (err) {
+	case 0:
+		return ST_OK;
+	case ETIMEDOUT:
+		return ST_TIMEDOUT;
+	case ECANCELED:
+		return ST_CANCELED;
+	case ENOMEM:
+		return ST_NOMEM;
+	case EAGAIN:
+	case EINTR:
+		return ST_AGAIN;
+	default:
+		return ST_OTHER;
+	}
+}
+
+/*
+ * One stress thread, a random call at a time on the file shared by all of
+ * them. Transfers are of random size, a cancel aborts whatever the other
+ * threads have in flight on the file.
+ */
+static void run_stress(struct bench_job *job, char *data)
+{
+	const struct bench_opts *o = job->opts;
+	struct bench_result *r = &job->result;
+	struct stream_config config;
+	enum stress_status st;
+	enum stress_op op;
+	unsigned int i;
+	size_t size;
+	__u32 type;
+	ssize_t ret;
+	double t;
+
+	for (i = 0; i < o->iterations; i++) {
+		op = rand_r(&job->seed) % NUM_OPS;
+		if ((op == OP_READ && !o->do_read) ||
+		    (op == OP_WRITE && !o->do_write))
+			op = OP_CONFIG;
+		size = o->min_size;
+		if (o->max_size > o->min_size)
+			size += rand_r(&job->seed) % (o->max_size - o->min_size);
+
+		t = now_us();
+		switch (op) {
+		case OP_READ:
+			ret = read(job->fd, data, size);
+			break;
+		case OP_WRITE:
+			ret = write(job->fd, data, size);
+			break;
+		case OP_CONFIG:
+			ret = ioctl(job->fd, GET_STREAM_CONFIG, &config);
+			break;
+		case OP_SEEK:
+			ret = lseek(job->fd, (rand_r(&job->seed) % 256) << 12,
+				    SEEK_SET);
+			ret = ret < 0 ? ret : 0;
+			break;
+		default:
+			type = BUF_TYPE_ALL;
+			ret = ioctl(job->fd, CANCEL_TRANSFERS, &type);
+			break;
+		}
+		r->lat_us[r->count++] = now_us() - t;
+
+		/* a positive return is a short copy, never expected */
+		st = stress_status(ret < 0 ? errno : ret ? EIO : 0);
+		r->calls[op][st]++;
+		if (st == ST_OTHER && !r->error)
+			r->error = ret < 0 ? -errno : -EIO;
+		if (op <= OP_WRITE && st == ST_OK)
+			r->bytes += size;
+	}
+}
+
+static void *run_stress_job(void *arg)
+{
+	struct bench_job *job = arg;
+	char *data;
+	double start;
+
+	data = malloc(job->opts->max_size);
+	if (!data) {
+		job->result.error = -ENOMEM;
+		return NULL;
+	}
+	memset(data, 0x5a, job->opts->max_size);
+
+	start = now_us();
+	run_stress(job, data);
+	job->result.elapsed = now_us() - start;
+
+	free(data);
+	return NULL;
+}
+
+static void *run_job(void *arg)
+{
+	struct bench_job *job = arg;
+	const struct bench_opts *o = job->opts;
+	int flags = O_RDWR;
+	char *data = NULL;
+	double start;
+	int fd, ret;
+
+	if (o->mode == MODE_ASYNC)
+		flags |= O_NONBLOCK;
+	fd = open(o->device, flags);
+	if (fd < 0) {
+		job->result.error = -errno;
+		return NULL;
+	}
+
+	if (o->mode != MODE_MMAP) {
+		data = malloc(job->size);
+		if (!data) {
+			close(fd);
+			job->result.error = -ENOMEM;
+			return NULL;
+		}
+		memset(data, 0x5a, job->size);
+	}
+
+	start = now_us();
+	switch (o->mode) {
+	case MODE_SYNC:
+		ret = run_sync(fd, job, data);
+		break;
+	case MODE_ASYNC:
+		ret = run_async(fd, job, data);
+		break;
+	default:
+		ret = run_mmap(fd, job);
+		break;
+	}
+	job->result.elapsed = now_us() - start;
+	job->result.error = ret;
+
+	free(data);
+	close(fd);
+	return NULL;
+}
+
+static void report(const struct bench_job *job, double cpu)
+{
+	const struct bench_result *r = &job->result;
+
+	if (r->error) {
+		printf("%-5s %10zu  error: %s\n", job->write ? "write" : "read",
+		       job->size, strerror(-r->error));
+		return;
+	}
+
+	qsort(r->lat_us, r->count, sizeof(*r->lat_us), cmp_double);
+	printf("%-5s %10zu %10.1f %10.1f %10.1f %10.1f %6.1f%%\n",
+	       job->write ? "write" : "read", job->size,
+	       r->elapsed ? r->bytes / r->elapsed : 0,
+	       percentile(r, 0.50), percentile(r, 0.99), percentile(r, 0.999),
+	       cpu);
+}
+
+static int run_size(const struct bench_opts *o, size_t size)
+{
+	struct bench_job jobs[2];
+	unsigned int i, n = 0;
+	double wall, cpu;
+
+	memset(jobs, 0, sizeof(jobs));
+	if (o->do_read)
+		jobs[n++].write = false;
+	if (o->do_write)
+		jobs[n++].write = true;
+
+	for (i = 0; i < n; i++) {
+		jobs[i].opts = o;
+		jobs[i].size = size;
+		jobs[i].result.lat_us = calloc(o->iterations, sizeof(double));
+		if (!jobs[i].result.lat_us)
+			return -ENOMEM;
+	}
+
+	/* full duplex runs both directions at once, one thread each */
+	wall = now_us();
+	cpu = cpu_us();
+	for (i = 0; i < n; i++)
+		pthread_create(&jobs[i].thread, NULL, run_job, &jobs[i]);
+	for (i = 0; i < n; i++)
+		pthread_join(jobs[i].thread, NULL);
+	cpu = (cpu_us() - cpu) * 100 / (now_us() - wall);
+
+	for (i = 0; i < n; i++) {
+		report(&jobs[i], cpu);
+		free(jobs[i].result.lat_us);
+	}
+
+	return 0;
+}
+
+static int run_stress_all(const struct bench_opts *o)
+{
+	struct bench_job jobs[MAX_THREADS];
+	unsigned long total[NUM_OPS][NUM_STATUS] = { };
+	unsigned int i, op, st, count = 0;
+	double wall, cpu, elapsed = 0;
+	int fd, error = 0;
+	size_t bytes = 0;
+	__u32 timeout = o->timeout_ms;
+
+	fd = open(o->device, O_RDWR);
+	if (fd < 0) {
+		error = -errno;
+		perror(o->device);
+		return error;
+	}
+	/* a lost completion has to come back as an error, not as a hang */
+	if (ioctl(fd, SET_TRANSFER_TIMEOUT, &timeout)) {
+		error = -errno;
+		perror("SET_TRANSFER_TIMEOUT");
+		close(fd);
+		return error;
+	}
+
+	memset(jobs, 0, sizeof(jobs));
+	for (i = 0; i < o->threads; i++) {
+		jobs[i].opts = o;
+		jobs[i].fd = fd;
+		jobs[i].seed = time(NULL) + i;
+		jobs[i].result.lat_us = calloc(o->iterations, sizeof(double));
+		if (!jobs[i].result.lat_us) {
+			while (i--)
+				free(jobs[i].result.lat_us);
+			close(fd);
+			return -ENOMEM;
+		}
+	}
+
+	wall = now_us();
+	cpu = cpu_us();
+	for (i = 0; i < o->threads; i++)
+		pthread_create(&jobs[i].thread, NULL, run_stress_job, &jobs[i]);
+	for (i = 0; i < o->threads; i++)
+		pthread_join(jobs[i].thread, NULL);
+	cpu = (cpu_us() - cpu) * 100 / (now_us() - wall);
+
+	for (i = 0; i < o->threads; i++) {
+		struct bench_result *r = &jobs[i].result;
+
+		for (op = 0; op < NUM_OPS; op++)
+			for (st = 0; st < NUM_STATUS; st++)
+				total[op][st] += r->calls[op][st];
+		if (r->error && !error)
+			error = r->error;
+		if (r->elapsed > elapsed)
+			elapsed = r->elapsed;
+		bytes += r->bytes;
+		count += r->count;
+		free(r->lat_us);
+	}
+	close(fd);
+
+	printf("%-7s", "call");
+	for (st = 0; st < NUM_STATUS; st++)
+		printf(" %10s", status_names[st]);
+	printf("\n");
+	for (op = 0; op < NUM_OPS; op++) {
+		printf("%-7s", op_names[op]);
+		for (st = 0; st < NUM_STATUS; st++)
+			printf(" %10lu", total[op][st]);
+		printf("\n");
+	}
+	printf("# %u calls, %.1f MB/s, %.1f%% cpu: %s\n", count,
+	       elapsed ? bytes / elapsed : 0, cpu,
+	       error ? strerror(-error) : "pass");
+
+	return error;
+}
+
+static size_t parse_size(const char *arg)
+{
+	char *end;
+	size_t v = strtoull(arg, &end, 0);
+
+	switch (*end) {
+	case 'k': case 'K':
+		return v << 10;
+	case 'm': case 'M':
+		return v << 20;
+	default:
+		return v;
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d DEV    device node (default /dev/pciep0)\n"
+		"  -m MODE   sync, async, mmap or stress (default sync)\n"
+		"  -D DIR    read, write or duplex (default read)\n"
+		"  -s MIN    smallest transfer size (default 4K)\n"
+		"  -S MAX    largest transfer size, doubled from MIN (default MIN)\n"
+		"  -q DEPTH  buffers in flight in mmap mode (default 2)\n"
+		"  -n ITER   transfers per size and direction, calls per thread\n"
+		"            in stress mode (default 1000)\n"
+		"  -t NUM    threads in stress mode, random sizes MIN to MAX\n"
+		"            (default 4)\n"
+		"  -T MS     transfer timeout in stress mode (default 1000)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts o = {
+		.device = "/dev/pciep0",
+		.mode = MODE_SYNC,
+		.do_read = true,
+		.min_size = 4096,
+		.depth = 2,
+		.iterations = 1000,
+		.threads = 4,
+		.timeout_ms = 1000,
+	};
+	size_t size;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:m:D:s:S:q:n:t:T:h")) != -1) {
+		switch (c) {
+		case 'd':
+			o.device = optarg;
+			break;
+		case 'm':
+			for (o.mode = MODE_SYNC; o.mode <= MODE_STRESS; o.mode++)
+				if (!strcmp(optarg, mode_names[o.mode]))
+					break;
+			if (o.mode > MODE_STRESS) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'D':
+			o.do_read = strcmp(optarg, "write") != 0;
+			o.do_write = strcmp(optarg, "read") != 0;
+			break;
+		case 's':
+			o.min_size = parse_size(optarg);
+			break;
+		case 'S':
+			o.max_size = parse_size(optarg);
+			break;
+		case 'q':
+			o.depth = atoi(optarg);
+			break;
+		case 'n':
+			o.iterations = atoi(optarg);
+			break;
+		case 't':
+			o.threads = atoi(optarg);
+			break;
+		case 'T':
+			o.timeout_ms = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return c != 'h';
+		}
+	}
+
+	if (o.max_size < o.min_size)
+		o.max_size = o.min_size;
+	if (!o.min_size || !o.iterations || !o.depth || o.depth > MAX_DEPTH ||
+	    !o.threads || o.threads > MAX_THREADS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (o.mode == MODE_STRESS) {
+		printf("# %s, stress mode, %u threads x %u calls\n", o.device,
+		       o.threads, o.iterations);
+		return run_stress_all(&o) ? 1 : 0;
+	}
+
+	printf("# %s, %s mode, %u transfers per size\n", o.device,
+	       mode_names[o.mode], o.iterations);
+	printf("%-5s %10s %10s %10s %10s %10s %7s\n", "dir", "size", "MB/s",
+	       "p50(us)", "p99(us)", "p999(us)", "cpu");
+	for (size = o.min_size; size <= o.max_size; size *= 2)
+		if (run_size(&o, size))
+			return 1;
+
+	return 0;
+}
@@ -14,15 +14,23 @@
 * Co-Author: Nayan Bhavsar <nayan.bhavsar@xilinx.com>
 */
 
+#include <linux/aio.h>
 #include <linux/cdev.h>
 #include <linux/clk.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/dma-buf.h>
 #include <linux/dma-mapping.h>
+#include <linux/fault-inject.h>
 #include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
 #include <linux/ioport.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/of.h>
@@ -30,23 +38,55 @@
 #include <linux/sched.h>
 #include <linux/device.h>
 #include <linux/platform_device.h>
+#include <linux/pm_runtime.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/sysctl.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/scatterlist.h>
 #include <linux/pagemap.h>
+#include <linux/poll.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
 #include <linux/list.h>
+#include <linux/hrtimer.h>
+#include <linux/huge_mm.h>
+#include <linux/pfn_t.h>
+#include <linux/ktime.h>
 #include <linux/spinlock.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 #include <linux/of_address.h>
 #include <linux/of_irq.h>
+#include <linux/of_reserved_mem.h>
 #include <asm/page.h>
 #include <asm/byteorder.h>
+#ifdef CONFIG_PCIEP_V4L2
+#include <media/v4l2-device.h>
+#include <media/v4l2-fh.h>
+#include <media/v4l2-ioctl.h>
+#include <media/videobuf2-dma-contig.h>
+#include <media/videobuf2-v4l2.h>
+#endif
+
+#include "xlnx_pcie_platform_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "xlnx_pcie_platform_trace.h"
 
 #define DEVICE_MAX_NUM                          256
 #define MAX_INSTANCES                           4
+#define DEFAULT_BUF_SIZE                        (4 * 1024 * 1024)
+#define DEFAULT_NUM_BUFS                        2
+#define MAX_NUM_BUFS                            32
+#define MAX_NUM_IMPORTS                         32
+#define DEFAULT_ADDR_WIDTH                      64
+#define DEFAULT_IOCB_TIMEOUT_MS                 10000
+#define PCIEP_LATENCY_BUCKETS                   24
+#define PCIEP_QOS_CLASSES                       (QOS_CLASS_BULK + 1)
 #define DRIVER_NAME                             "pciep"
 #define DEVICE_NAME_FORMAT                      "pciep%d"
 
@@ -63,6 +103,8 @@
 #define PCIEP_READ_TRANSFER_CLR                 0x28
 #define PCIEP_READ_BUFFER_HOST_INTR             0x2c
 #define PCIEP_WRITE_TRANSFER_CLR                0x30
+#define PCIEP_READ_BUFFER_ADDR_HIGH             0x34
+#define PCIEP_WRITE_BUFFER_ADDR_HIGH            0x38
 
 #define PCIRC_READ_FILE_LENGTH                  0x40
 #define PCIRC_READ_BUFFER_TRANSFER_DONE         0x44
@@ -84,19 +126,6 @@
 #define SET_BUFFER_RDY                          0x1
 #define SET_TRANSFER_DONE                       0x1
 
-#define GET_FILE_LENGTH                         0x0
-#define GET_ENC_PARAMS                          0x1
-#define SET_READ_OFFSET                         0x2
-#define SET_WRITE_OFFSET                        0x3
-#define SET_READ_TRANSFER_DONE                  0x5
-#define CLR_READ_TRANSFER_DONE                  0x6
-#define SET_WRITE_TRANSFER_DONE                 0x7
-#define CLR_WRITE_TRANSFER_DONE                 0x8
-#define GET_RESOLUTION                          0x9
-#define GET_MODE                                0xa
-#define GET_FPS                                 0xb
-#define GET_FORMAT                              0xc
-
 #define WIDTH_SHIFT                             0x0
 #define WIDTH_MASK                              0xFFFF
 #define HEIGHT_SHIFT                            16
@@ -151,70 +180,501 @@
 #define WRITE_BUF_HIGH_OFFSET                   0xFFFF0000
 
 static DEFINE_IDA(pciep_device_ida);
+/* live instances by minor, the character device open looks them up */
+static struct pciep_driver_data *pciep_devices[MAX_INSTANCES];
+static DEFINE_MUTEX(pciep_devices_lock);
 static dev_t  pciep_device_number;
 static bool pciep_platform_driver_done;
 static struct class *pciep_sys_class;
-static DEFINE_MUTEX(pcie_read_mutex);
-static DEFINE_MUTEX(pcie_write_mutex);
+static struct dentry *pciep_debugfs_root;
+
+static unsigned int buf_size;
+module_param(buf_size, uint, 0444);
+MODULE_PARM_DESC(buf_size,
+		 "Size in bytes of each pooled DMA buffer (0: DT or default)");
+
+static unsigned int num_bufs;
+module_param(num_bufs, uint, 0444);
+MODULE_PARM_DESC(num_bufs,
+		 "Number of pooled DMA buffers per direction (0: DT or default)");
+
+static unsigned int direct_io_threshold;
+module_param(direct_io_threshold, uint, 0644);
+MODULE_PARM_DESC(direct_io_threshold,
+		 "Min blocking transfer size done in place on user pages (0: off)");
+
+static unsigned int coalesce_frames = 1;
+module_param(coalesce_frames, uint, 0644);
+MODULE_PARM_DESC(coalesce_frames,
+		 "Completions gathered before waking up the waiters (0/1: each)");
+
+static unsigned int coalesce_usecs;
+module_param(coalesce_usecs, uint, 0644);
+MODULE_PARM_DESC(coalesce_usecs,
+		 "Max delay in us of a coalesced wake up (0: no coalescing)");
+
+static unsigned int busy_poll_usecs;
+module_param(busy_poll_usecs, uint, 0644);
+MODULE_PARM_DESC(busy_poll_usecs,
+		 "Time in us a blocking transfer spins before sleeping (0: off)");
+
+static unsigned int transfer_timeout_ms;
+module_param(transfer_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(transfer_timeout_ms,
+		 "Default deadline in ms of a blocking transfer (0: none)");
+
+static int autosuspend_ms = 1000;
+module_param(autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_ms,
+		 "Idle time in ms before the endpoint is suspended (<0: never)");
+
+/*
+ * Pool buffer life cycle: FREE buffers sit in the free list and can be
+ * taken by read()/write() or QUEUE_BUF. A FREE buffer mapped to userspace
+ * is kept off the free list, the application may be filling it, and is
+ * only taken by QUEUE_BUF or a read_iter()/write_iter() in place. QUEUED
+ * buffers wait in the ring of their path, the first one being programmed
+ * into the endpoint. The transfer done interrupt moves them to the DONE
+ * list, from which they are handed back to read()/write() or DEQUEUE_BUF
+ * as USER buffers. USER buffers queued through QUEUE_BUF belong to that
+ * file until it closes the device. A USER buffer without owner is
+ * detached: an exported pool buffer whose file went away, waiting for its
+ * last dma-buf reference, or an import waiting to be reclaimed.
+ */
+enum pciep_buffer_state {
+	PCIEP_BUF_FREE,
+	PCIEP_BUF_QUEUED,
+	PCIEP_BUF_DONE,
+	PCIEP_BUF_USER,
+};
+
+/**
+ * struct pciep_buffer - DMA buffer used for one transfer
+ * @list: entry in the free, queued or done list of the owning path
+ * @index: index of the buffer in the pool
+ * @pooled: buffer belongs to the pool, false for one-off allocations
+ * @cached: cached streaming pool buffer, handed over with
+ *	pciep_buffer_sync()
+ * @orphan: nobody waits for the buffer, return it to the pool once done
+ * @rw: queued by a non-blocking read()/write() rather than QUEUE_BUF
+ * @withdrawn: aborted while programmed into the endpoint, the host may
+ *	still access it until the next transfer done interrupt
+ * @state: position of the buffer in its life cycle
+ * @owner: file that queued the buffer, NULL for read()/write()
+ * @stream: stream the current transfer was queued for
+ * @size: size of the buffer in bytes
+ * @bytesused: no.of bytes of the current transfer
+ * @offset: host offset of the current transfer
+ * @submitted: time the current transfer was queued
+ * @qos_class: QoS class of the stream when the current transfer was queued
+ * @completed: time the transfer done interrupt of the current transfer
+ *	fired
+ * @host_done: time of the last host done interrupt while the current
+ *	transfer was in flight, 0 if there was none
+ * @dev: device the buffer was allocated from
+ * @complete: called on completion, with path->lock held, instead of moving
+ *	the buffer to the done list
+ * @iocb: asynchronous read_iter()/write_iter() the transfer completes
+ * @deadline: time @iocb times out at
+ * @virt_addr: virtual address of the buffer
+ * @phys_addr: bus address programmed into the endpoint
+ * @exported: no.of live dma-bufs exported from this pool buffer
+ * @mapped: no.of live mappings of this pool buffer
+ * @dmabuf: imported dma-buf, NULL for driver allocated buffers
+ * @attach: attachment of @dmabuf to the endpoint
+ * @sgt: mapping of @attach
+ * @dma_dir: direction @attach is mapped or @cached buffer synced for
+ */
+struct pciep_buffer {
+	struct list_head list;
+	u32 index;
+	bool pooled;
+	bool cached;
+	bool orphan;
+	bool rw;
+	bool withdrawn;
+	enum pciep_buffer_state state;
+	struct file *owner;
+	struct pciep_stream *stream;
+	size_t size;
+	size_t bytesused;
+	u64 offset;
+	ktime_t submitted;
+	u32 qos_class;
+	ktime_t completed;
+	ktime_t host_done;
+	struct device *dev;
+	void (*complete)(struct pciep_buffer *buf);
+	struct kiocb *iocb;
+	ktime_t deadline;
+	void *virt_addr;
+	dma_addr_t phys_addr;
+	unsigned int exported;
+	unsigned int mapped;
+	struct dma_buf *dmabuf;
+	struct dma_buf_attachment *attach;
+	struct sg_table *sgt;
+	enum dma_data_direction dma_dir;
+};
+
+/**
+ * struct pciep_path_stats - per-direction counters, one copy per CPU
+ * @bytes: no.of bytes transferred
+ * @transfers: no.of transfers completed
+ * @alloc_failures: no.of failed one-off buffer allocations
+ * @irqs: no.of transfer done interrupts
+ * @spurious_irqs: no.of interrupts on the shared line that were not ours
+ * @wait_ns: time callers spent blocked waiting for transfers
+ * @aborted: no.of transfers aborted by a timeout, a signal or a cancel
+ * @latency: log2 histogram of the queue to completion time in us,
+ *	bucket 0 counts transfers under 1us, bucket i those under 2^i us
+ * @qos_transfers: no.of transfers programmed, per QoS class
+ * @qos_delay_ns: time transfers waited in the ring before they were
+ *	programmed, per QoS class
+ */
+struct pciep_path_stats {
+	u64 bytes;
+	u64 transfers;
+	u64 alloc_failures;
+	u64 irqs;
+	u64 spurious_irqs;
+	u64 wait_ns;
+	u64 aborted;
+	u64 latency[PCIEP_LATENCY_BUCKETS];
+	u64 qos_transfers[PCIEP_QOS_CLASSES];
+	u64 qos_delay_ns[PCIEP_QOS_CLASSES];
+};
+
+/**
+ * struct pciep_stats - per device counters, one copy per CPU
+ * @read: read path counters
+ * @write: write path counters
+ * @host_done_irqs: no.of host done interrupts
+ * @host_done_spurious_irqs: no.of host done interrupts that were not ours
+ * @pm_suspends: no.of runtime suspends
+ * @pm_suspend_ns: time spent in the runtime suspend callback
+ * @pm_resumes: no.of runtime resumes
+ * @pm_resume_ns: time spent in the runtime resume callback
+ */
+struct pciep_stats {
+	struct pciep_path_stats read;
+	struct pciep_path_stats write;
+	u64 host_done_irqs;
+	u64 host_done_spurious_irqs;
+	u64 pm_suspends;
+	u64 pm_suspend_ns;
+	u64 pm_resumes;
+	u64 pm_resume_ns;
+};
+
+/**
+ * struct pciep_path_regs - per-direction register layout
+ * @ready: buffer ready register, also holding the offset bits 47:32
+ * @addr: buffer address register, address bits 31:0
+ * @addr_high: buffer address register, address bits 63:32
+ * @offset: buffer offset register, offset bits 31:0
+ * @size: buffer size register
+ * @high_offset_mask: offset bits 47:32 in @ready
+ */
+struct pciep_path_regs {
+	u32 ready;
+	u32 addr;
+	u32 addr_high;
+	u32 offset;
+	u32 size;
+	u32 high_offset_mask;
+};
+
+static const struct pciep_path_regs pciep_read_regs = {
+	.ready            = PCIEP_READ_BUFFER_READY,
+	.addr             = PCIEP_READ_BUFFER_ADDR,
+	.addr_high        = PCIEP_READ_BUFFER_ADDR_HIGH,
+	.offset           = PCIEP_READ_BUFFER_OFFSET,
+	.size             = PCIEP_READ_BUFFER_SIZE,
+	.high_offset_mask = READ_BUF_HIGH_OFFSET,
+};
+
+static const struct pciep_path_regs pciep_write_regs = {
+	.ready            = PCIEP_WRITE_BUFFER_READY,
+	.addr             = PCIEP_WRITE_BUFFER_ADDR,
+	.addr_high        = PCIEP_WRITE_BUFFER_ADDR_HIGH,
+	.offset           = PCIEP_WRITE_BUFFER_OFFSET,
+	.size             = PCIEP_WRITE_BUFFER_SIZE,
+	.high_offset_mask = WRITE_BUF_HIGH_OFFSET,
+};
+
+/**
+ * struct pciep_path - per-direction transfer state
+ * @name: direction name used in messages
+ * @regs: register layout of this direction
+ * @lock: protects the lists, @active, the buffer states and the register
+ *	shadows
+ * @bufs: buffer pool, allocated once at probe
+ * @free: pool buffers not used by any transfer
+ * @imports: dma-bufs imported as transfer targets
+ * @queued: buffers waiting for the endpoint, in submission order
+ * @done: completed buffers not yet handed back
+ * @active: buffer currently programmed into the endpoint
+ * @unreported: completions the waiters were not woken up for yet
+ * @coalesce_timer: bounds the delay of a coalesced wake up
+ * @stats: counters of this direction
+ * @wait: woken up whenever buffers complete
+ * @shadow_ready: last value written to the buffer ready register
+ * @shadow_offset: last value written to the buffer offset register
+ * @shadow_addr_high: last value written to the address high register
+ * @pm_busy: a transfer in flight holds a runtime PM reference
+ * @irq_time: time the last transfer done interrupt fired, taken by the
+ *	hard interrupt handler for the thread to stamp the buffer with
+ * @sched_timer: comes back for streams held back by their bandwidth cap
+ * @sched_gen: scheduling round, see __pciep_path_pick()
+ * @vtime: virtual time of the transfer programmed last
+ * @dio_held: direct I/O transfers with a withdrawn chunk, their user pages
+ *	stay pinned until the host is known to be done with them
+ * @dio_retired: direct I/O transfers @dio_work releases
+ * @dio_work: unpins and frees @dio_retired, which may sleep
+ * @iocb_timer: comes back for the earliest deadline of an asynchronous
+ *	read_iter()/write_iter()
+ * @iocb_work: completes the asynchronous read_iter()/write_iter() calls
+ *	cancelled through aio
+ *
+ * Only the driver writes the buffer registers, so their shadows stand in
+ * for reading them back and the submit path issues nothing but posted
+ * writes.
+ *
+ * Each direction is fully independent, a reader and a writer never
+ * contend on anything but the register space. Concurrent users of the
+ * same direction are served by QoS class and weight, the transfers of
+ * one stream in submission order, each transfer carrying its own buffer
+ * and offset.
+ */
+struct pciep_path {
+	const char *name;
+	const struct pciep_path_regs *regs;
+	spinlock_t lock;
+	struct pciep_buffer *bufs;
+	struct list_head free;
+	struct pciep_buffer *imports[MAX_NUM_IMPORTS];
+	struct list_head queued;
+	struct list_head done;
+	struct pciep_buffer *active;
+	unsigned int unreported;
+	struct hrtimer coalesce_timer;
+	struct pciep_path_stats __percpu *stats;
+	wait_queue_head_t wait;
+	u32 shadow_ready;
+	u32 shadow_offset;
+	u32 shadow_addr_high;
+	bool pm_busy;
+	ktime_t irq_time;
+	struct hrtimer sched_timer;
+	u64 sched_gen;
+	u64 vtime;
+	struct list_head dio_held;
+	struct list_head dio_retired;
+	struct work_struct dio_work;
+	struct hrtimer iocb_timer;
+	struct work_struct iocb_work;
+};
 
 /**
  * struct pciep_driver_data - Plmem driver data
  * @sys_dev: character device pointer
- * @cdev: character device structure
- * @complete: completion variable
+ * @ref: lifetime of the structure, see pciep_get()
+ * @dead: the device was removed, only releases are served
+ * @ops: no.of entry points in progress, see pciep_op_begin()
+ * @ops_wait: woken up when the last of @ops ends after the removal
+ * @cdev: character device, allocated on its own as open files keep it
  * @device_number: character driver device number
- * @is_open: holds whether file is opened
- * @size: size of memory pool
+ * @lock: serializes open and release
+ * @open_count: no.of open files, the character device's and the V4L2
+ *	node's
+ * @pl_dev: device allocating from the PL DDR region, NULL without one
+ * @placement: BUF_PLACEMENT_PS or BUF_PLACEMENT_PL
+ * @cache: BUF_CACHE_UNCACHED or BUF_CACHE_STREAMING pool buffers
+ * @coherent: the endpoint snoops the CPU caches ("dma-coherent")
+ * @mmaps: no.of live mappings of pool buffers
+ * @size: size of each pooled DMA buffer
+ * @num_bufs: number of pooled DMA buffers per direction
  * @count: no.of bytes to transfer
- * @virt_addr: virtual address of memory region
- * @phys_addr: physical address of memory region
- * @mem_used: holds whether pool is uses or not
+ * @config_lock: protects @config and @config_valid
+ * @config: cached host configuration
+ * @config_valid: @config matches the registers
+ * @config_wait: woken up when the host changes the configuration
+ * @stats: performance counters
+ * @debugfs: debugfs directory of the device
+ * @v4l2: V4L2 capture front-end, NULL without one
+ * @clk: clock of the register block, NULL without one in the DT
+ * @suspended: runtime suspended, the registers must not be touched
+ * @pm_handshake: transfer done flags raised, indexed by
+ *	pciep_is_write(), each holding a runtime PM reference
+ * @host_done_work: resumes the endpoint for an interrupt on the host done
+ *	line while suspended
+ * @pm_resume_max_ns: longest runtime resume so far
+ * @host_done_time: time the last host done interrupt fired
+ * @fail_irq: fault injection, transfer done interrupts acked and dropped
+ * @fail_delay: fault injection, transfer completions held back by
+ *	@fail_delay_ms
+ * @fail_delay_ms: how long a @fail_delay completion is held back
+ * @fail_alloc: fault injection, transfer buffers failing with -ENOMEM
+ * @fail_host_done: fault injection, host done events raised right after
+ *	a completion, while the next transfer may be in flight
+ * @read_path: host to endpoint transfer state
+ * @write_path: endpoint to host transfer state
  */
 struct pciep_driver_data {
 	struct device *sys_dev;
+	struct kref ref;
+	bool dead;
+	atomic_t ops;
+	wait_queue_head_t ops_wait;
 	struct device *dma_dev;
+	struct device *pl_dev;
+	u32 placement;
+	u32 cache;
+	bool coherent;
+	atomic_t mmaps;
 	void __iomem *regs;
 	int rd_irq;
 	int wr_irq;
 	int host_done_irq;
-	struct cdev cdev;
-	struct completion read_complete;
-	struct completion write_complete;
+	struct cdev *cdev;
 	dev_t device_number;
-	bool is_open;
+	struct mutex lock;
+	unsigned int open_count;
 	int size;
+	u32 num_bufs;
 	int count;
-	void *read_virt_addr;
-	void *write_virt_addr;
-	dma_addr_t read_phys_addr;
-	dma_addr_t write_phys_addr;
+	struct mutex config_lock;
+	struct stream_config config;
+	bool config_valid;
+	wait_queue_head_t config_wait;
+	struct pciep_stats __percpu *stats;
+	struct dentry *debugfs;
+#ifdef CONFIG_PCIEP_V4L2
+	struct pciep_v4l2 *v4l2;
+#endif
+	struct clk *clk;
+	bool suspended;
+	unsigned long pm_handshake;
+	struct work_struct host_done_work;
+	u64 pm_resume_max_ns;
+	ktime_t host_done_time;
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+	struct fault_attr fail_irq;
+	struct fault_attr fail_delay;
+	u32 fail_delay_ms;
+	struct fault_attr fail_alloc;
+	struct fault_attr fail_host_done;
+#endif
+	struct pciep_path read_path;
+	struct pciep_path write_path;
+};
+
+/*
+ * Streaming engines run by the driver on behalf of a stream: FILE returns
+ * the prefetched chunks of the host file through read(), PIPELINE cycles
+ * raw frames through the read ring and lays the encoded frames queued on
+ * the write ring out back to back.
+ */
+enum pciep_engine {
+	PCIEP_ENGINE_OFF,
+	PCIEP_ENGINE_FILE,
+	PCIEP_ENGINE_PIPELINE,
+};
+
+/**
+ * struct pciep_stream_sched - scheduling state of one direction of a stream
+ * @vtime: virtual time the next transfer of the stream starts at, the
+ *	bytes it was served scaled down by its weight
+ * @next: earliest time the bandwidth cap lets the next transfer start
+ * @gen: scheduling round the stream was last looked at in
+ *
+ * Protected by the lock of the path.
+ */
+struct pciep_stream_sched {
+	u64 vtime;
+	ktime_t next;
+	u64 gen;
+};
+
+/**
+ * struct pciep_stream - per file stream context
+ * @this: device the stream runs on
+ * @read_offset: host offset of the next read transfer of the stream
+ * @write_offset: host offset of the next write transfer of the stream
+ * @config_gen: configuration generation last returned by GET_STREAM_CONFIG
+ * @timeout_ms: deadline of the blocking transfers of the stream, 0: none
+ * @file_lock: serializes the engine of the stream
+ * @engine: streaming engine running on the stream
+ * @file_len: length of the streamed file
+ * @file_base: host offset the streamed file starts at
+ * @file_pos: no.of bytes of the file returned by read() so far
+ * @file_queued: no.of bytes of the file queued to the endpoint so far
+ * @file_chunk: size of the chunks the file is transferred in
+ * @file_cur: completed chunk being consumed, NULL if none
+ * @file_cur_pos: no.of bytes of @file_cur already consumed
+ * @pipe_last: raw frame handed out last by the pipeline, NULL if none
+ * @pipe_read_done: SET_READ_TRANSFER_DONE was raised by the pipeline
+ * @pipe_write_base: host offset the encoded frames start at
+ * @pipe_write_pos: no.of encoded bytes queued by the pipeline so far
+ * @read_spare: one-off read buffer kept for the next oversized read
+ * @write_spare: one-off write buffer kept for the next oversized write
+ * @qos_class: QOS_CLASS_* of the transfers queued from now on
+ * @qos_weight: share of the stream within its class
+ * @qos_rate: bandwidth cap of each direction in bytes/s, 0: none
+ * @sched: scheduling state, indexed by pciep_is_write()
+ *
+ * Every open file is one stream. Streams share the transfer paths of
+ * the device and are told apart by the host offsets they transfer at.
+ */
+struct pciep_stream {
+	struct pciep_driver_data *this;
+	u64 read_offset;
+	u64 write_offset;
+	u32 config_gen;
+	unsigned int timeout_ms;
+	struct mutex file_lock;
+	enum pciep_engine engine;
+	u64 file_len;
+	u64 file_base;
+	u64 file_pos;
+	u64 file_queued;
+	size_t file_chunk;
+	struct pciep_buffer *file_cur;
+	size_t file_cur_pos;
+	struct pciep_buffer *pipe_last;
+	bool pipe_read_done;
+	u64 pipe_write_base;
+	u64 pipe_write_pos;
+	struct pciep_buffer *read_spare;
+	struct pciep_buffer *write_spare;
+	u32 qos_class;
+	u32 qos_weight;
+	u64 qos_rate;
+	struct pciep_stream_sched sched[2];
 };
 
-typedef struct enc_params {
-	bool enable_l2Cache;
-	bool low_bandwidth;
-	bool filler_data;
-	bool max_picture_size;
-	unsigned int bitrate;
-	unsigned int gop_len;
-	unsigned int b_frame;
-	unsigned int slice;
-	unsigned int qp_mode;
-	unsigned int rc_mode;
-	unsigned int enc_type;
-	unsigned int gop_mode;
-	unsigned int profile;
-	unsigned int min_qp;
-	unsigned int max_qp;
-	unsigned int cpb_size;
-	unsigned int initial_delay;
-	unsigned int periodicity_idr;
-} enc_params;
-
-typedef struct resolution {
-	unsigned int width;
-	unsigned int height;
-} resolution;
+/**
+ * struct pciep_dio - direct I/O transfer on pinned user pages
+ * @list: entry in the dio_held or dio_retired list of the path
+ * @dev: device the pages are mapped for
+ * @dir: direction of the mapping
+ * @pages: pinned user pages
+ * @pinned: no.of entries of @pages pinned
+ * @sgt: DMA mapping of @pages
+ * @chunks: chunk descriptors, one per DMA segment of @sgt
+ * @nents: no.of @chunks
+ */
+struct pciep_dio {
+	struct list_head list;
+	struct device *dev;
+	enum dma_data_direction dir;
+	struct page **pages;
+	int pinned;
+	struct sg_table sgt;
+	struct pciep_buffer *chunks;
+	unsigned int nents;
+};
 
 static inline u32 reg_read(struct pciep_driver_data *this, u32 reg)
 {
@@ -227,385 +687,5349 @@ static inline void reg_write(struct pciep_driver_data *this, u32 reg,
 	iowrite32(value, this->regs + reg);
 }
 
-
-static int pcie_reset_all(struct pciep_driver_data *this)
+/* no barrier, only ordered against the other register accesses */
+static inline void reg_write_relaxed(struct pciep_driver_data *this, u32 reg,
+				     u32 value)
 {
-	if (this) {
-		reg_write(this, PCIEP_READ_TRANSFER_DONE, PCIEP_CLR_REG);
-		reg_write(this, PCIEP_WRITE_TRANSFER_DONE, PCIEP_CLR_REG);
-		reg_write(this, PCIEP_READ_BUFFER_OFFSET, PCIEP_CLR_REG);
-		reg_write(this, PCIEP_READ_BUFFER_SIZE, PCIEP_CLR_REG);
-		reg_write(this, PCIEP_WRITE_BUFFER_SIZE, PCIEP_CLR_REG);
-		reg_write(this, PCIEP_READ_BUFFER_READY, PCIEP_CLR_REG);
-		reg_write(this, PCIEP_WRITE_BUFFER_READY, PCIEP_CLR_REG);
-	}
-	else {
-		return -EINVAL;
-	}
+	writel_relaxed(value, this->regs + reg);
+}
 
-	return 0;
+static inline void pciep_op_end(struct pciep_driver_data *this)
+{
+	if (atomic_dec_and_test(&this->ops) && READ_ONCE(this->dead))
+		wake_up(&this->ops_wait);
 }
 
-/**
- * pciep_driver_file_open() - This is the driver open function.
- * @inode:	Pointer to the inode structure of this device.
- * @file:	Pointer to the file structure.
- * Return:      Success(=0) or error status(<0).
+/*
+ * Entry points touching the registers, the rings or the timers run
+ * between pciep_op_begin() and pciep_op_end(). Files, mappings and
+ * dma-bufs outlive the removal, which marks the device dead and waits
+ * for the entry points in progress before the registers go away.
  */
-static int pciep_driver_file_open(struct inode *inode, struct file *file)
+static inline int pciep_op_begin(struct pciep_driver_data *this)
 {
-	struct pciep_driver_data *this;
-	int status = 0;
-
-	this = container_of(inode->i_cdev, struct pciep_driver_data, cdev);
-	file->private_data = this;
-	this->is_open = 1;
-
-	pcie_reset_all(this);
-
-	return status;
+	atomic_inc(&this->ops);
+	/* pairs with the barrier in pciep_driver_destroy() */
+	smp_mb__after_atomic();
+	if (READ_ONCE(this->dead)) {
+		pciep_op_end(this);
+		return -ENODEV;
+	}
+	return 0;
 }
 
-/**
- * pciep_driver_file_release() - This is the driver release function.
- * @inode:	Pointer to the inode structure of this device.
- * @file:	Pointer to the file structure.
- * Return:      Success(=0) or error status(<0).
+/*
+ * Runtime PM reference of an operation touching the registers. Transfers
+ * still in flight when it returns hold one of their own, see
+ * __pciep_path_pm().
  */
-static int pciep_driver_file_release(struct inode *inode, struct file *file)
+static inline int pciep_pm_get(struct pciep_driver_data *this)
 {
-	struct pciep_driver_data *this = file->private_data;
-	u32 value;
+	int ret;
 
-	/* Terminate DMA transfer and reset required flags */
-	this->is_open = 0;
+	ret = pciep_op_begin(this);
+	if (ret)
+		return ret;
+	ret = pm_runtime_resume_and_get(this->dma_dev);
+	if (ret)
+		pciep_op_end(this);
+	return ret;
+}
 
-	/* clear all the registers */
-	reg_write(this, PCIEP_READ_BUFFER_OFFSET, PCIEP_CLR_REG);
-	value = reg_read(this, PCIEP_READ_BUFFER_READY);
-	value &= ~READ_BUF_HIGH_OFFSET;
-	reg_write(this, PCIEP_READ_BUFFER_READY, value);
-	reg_write(this, PCIEP_READ_BUFFER_SIZE, PCIEP_CLR_REG);
-	reg_write(this, PCIEP_WRITE_BUFFER_SIZE, PCIEP_CLR_REG);
+static inline void __pciep_pm_put(struct pciep_driver_data *this)
+{
+	pm_runtime_mark_last_busy(this->dma_dev);
+	pm_runtime_put_autosuspend(this->dma_dev);
+}
 
-	return 0;
+static inline void pciep_pm_put(struct pciep_driver_data *this)
+{
+	__pciep_pm_put(this);
+	pciep_op_end(this);
 }
 
 /**
- * pciep_driver_file_mmap() - This is the driver memory map function.
- * @file:	Pointer to the file structure.
- * @vma:        Pointer to the vm area structure.
- * Return:      Success(=0) or error status(<0).
+ * pciep_transfer_done() - Raise or clear a transfer done flag.
+ * @this:	Pointer to the pciep driver data structure, resumed.
+ * @write:	Write direction flag rather than the read one.
+ * @raise:	Raise the flag rather than clear it.
+ *
+ * The host polls the flag through the register space and answers with a
+ * host done, a raised flag keeps the endpoint resumed until then.
  */
-static int pciep_driver_file_mmap(struct file *file, struct vm_area_struct *vma)
+static void pciep_transfer_done(struct pciep_driver_data *this, bool write,
+				bool raise)
 {
-	return 0;
+	reg_write(this, write ? PCIEP_WRITE_TRANSFER_DONE :
+				PCIEP_READ_TRANSFER_DONE,
+		  raise ? 0xef : PCIEP_CLR_REG);
+	if (raise) {
+		if (!test_and_set_bit(write, &this->pm_handshake))
+			pm_runtime_get_noresume(this->dma_dev);
+	} else if (test_and_clear_bit(write, &this->pm_handshake)) {
+		__pciep_pm_put(this);
+	}
 }
 
-static long pciep_driver_file_ioctl(struct file *file, unsigned int cmd,
-			unsigned long arg)
-{
-	struct pciep_driver_data *this = file->private_data;
-	unsigned int value;
-	u64 value1;
-	u64 value2;
-	u64 value3;
-	u64 value4;
-	u64 size;
-	struct enc_params params;
-	struct resolution res;
-	int ret;
+/*
+ * Fault injection points, configured under debugfs <dev>/fail_*. The
+ * attributes are zeroed, and so never fail, until pciep_debugfs_init()
+ * sets them up.
+ */
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+#define pciep_should_fail(this, fault)	should_fail(&(this)->fault, 1)
+#else
+#define pciep_should_fail(this, fault)	false
+#endif
 
-	switch (cmd) {
-	case GET_FILE_LENGTH:
-		value = reg_read(this, PCIRC_READ_FILE_LENGTH);
-		value1 = reg_read(this, (PCIRC_READ_FILE_LENGTH - 4));
-		size = value | value1 << 32;
-		ret = copy_to_user((u64 *) arg, &size, sizeof(size));
-		return ret;
+/* tracepoint arguments */
+#define pciep_minor(this)		MINOR((this)->device_number)
+#define pciep_is_write(this, path)	((path) == &(this)->write_path)
 
-	case GET_ENC_PARAMS:
-		value = reg_read(this, PCIRC_ENC_PARAMS_1);
-		params.enable_l2Cache = (value>>L2CACHE_SHIFT) & L2CACHE_MASK;
-		params.low_bandwidth = (value>>LOW_BANDWIDTH_SHIFT) & LOW_BANDWIDTH_MASK;
-		params.filler_data = (value>>FILLER_DATA_SHIFT) & FILLER_DATA_MASK;
-		params.bitrate = (value>>BITRATE_SHIFT) & BITRATE_MASK;
-		params.gop_len = (value>>GOP_LENGTH_SHIFT) & GOP_LENGTH_MASK;
-		params.max_picture_size = (value>>MAX_PICTURE_SIZE_SHIFT) & MAX_PICTURE_SIZE_MASK;
-
-		value1 = reg_read(this, PCIRC_ENC_PARAMS_2);
-		params.b_frame = (value1>>B_FRAME_SHIFT) & B_FRAME_MASK;
-		params.slice = (value1>>SLICE_SHIFT) & SLICE_MASK;
-		params.qp_mode = (value1>>QP_MODE_SHIFT) & QP_MODE_MASK;
-		params.rc_mode = (value1>>RC_MODE_SHIFT) & RC_MODE_MASK;
-		params.enc_type = (value1>>ENC_TYPE_SHIFT) & ENC_TYPE_MASK;
-		params.gop_mode = (value1>>GOP_MODE_SHIFT) & GOP_MODE_MASK;
-		params.profile = (value1>>PROFILE_SHIFT) & PROFILE_MASK;
-		params.min_qp = (value1>>MIN_QP_SHIFT) & MIN_QP_MASK;
-		params.max_qp = (value1>>MAX_QP_SHIFT) & MAX_QP_MASK;
-
-		value2 = reg_read(this, PCIRC_ENC_PARAMS_3);
-		params.cpb_size = (value2>>CPB_SIZE_SHIFT) & CPB_SIZE_MASK;
-		value3 = reg_read(this, PCIRC_ENC_PARAMS_4);
-		params.initial_delay = (value3>>INITIAL_DELAY_SHIFT) & INITIAL_DELAY_MASK;
-		value4 = reg_read(this, PCIRC_ENC_PARAMS_5);
-		params.periodicity_idr = (value4>>PERIODICITY_IDR_SHIFT) & PERIODICITY_IDR_MASK;
-		ret = copy_to_user((struct enc_params *) arg, &params, sizeof(params));
-		return ret;
+/* device a path belongs to, for callbacks that only get the path */
+static struct pciep_driver_data *pciep_path_to_this(struct pciep_path *path)
+{
+	if (path->regs == &pciep_write_regs)
+		return container_of(path, struct pciep_driver_data, write_path);
+	return container_of(path, struct pciep_driver_data, read_path);
+}
 
-	case GET_RESOLUTION:
-		value = reg_read(this, PCIRC_RAW_RESOLUTION);
-		res.width = (value>>WIDTH_SHIFT) & WIDTH_MASK;
-		res.height = (value>>HEIGHT_SHIFT) & HEIGHT_MASK;
-		ret = copy_to_user((struct resolution *) arg, &res, sizeof(res));
-		return ret;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#define pciep_dma_buf_map	dma_buf_map_attachment_unlocked
+#define pciep_dma_buf_unmap	dma_buf_unmap_attachment_unlocked
+#else
+#define pciep_dma_buf_map	dma_buf_map_attachment
+#define pciep_dma_buf_unmap	dma_buf_unmap_attachment
+#endif
 
-	case GET_MODE:
-		value = reg_read(this, PCIRC_USECASE_MODE);
-		value = (value >> USE_CASE_MODE_SHIFT) & USE_CASE_MODE_MASK;
-		ret = copy_to_user((u32 *) arg, &value, sizeof(value));
-		return ret;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+#define pciep_vm_flags_set	vm_flags_set
+#else
+#define pciep_vm_flags_set(vma, flags)	((vma)->vm_flags |= (flags))
+#endif
 
-	case SET_READ_OFFSET:
-		ret = copy_from_user(&value1, (u64 *) arg, sizeof(value1));
-		reg_write(this, PCIEP_READ_BUFFER_OFFSET, value1);
-	        value = reg_read(this, PCIEP_READ_BUFFER_READY);
-	        value &= ~READ_BUF_HIGH_OFFSET;
-	        value |= (value1 >> 16) & READ_BUF_HIGH_OFFSET;
-	        reg_write(this, PCIEP_READ_BUFFER_READY, value);
-		return ret;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#define pciep_fault_size	unsigned int
+#define PCIEP_FAULT_PMD		PMD_ORDER
+#else
+#define pciep_fault_size	enum page_entry_size
+#define PCIEP_FAULT_PMD		PE_SIZE_PMD
+#endif
 
-	case SET_WRITE_OFFSET:
-		ret = copy_from_user(&value1, (u64 *) arg, sizeof(value1));
-		reg_write(this, PCIEP_WRITE_BUFFER_OFFSET, value1);
-	        value = reg_read(this, PCIEP_WRITE_BUFFER_READY);
-	        value &= ~WRITE_BUF_HIGH_OFFSET;
-	        value |= (value1 >> 16) & WRITE_BUF_HIGH_OFFSET;
-	        reg_write(this, PCIEP_WRITE_BUFFER_READY, value);
-		return ret;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+#define pciep_ki_complete(iocb, res)	((iocb)->ki_complete(iocb, res))
+#else
+#define pciep_ki_complete(iocb, res)	((iocb)->ki_complete(iocb, res, 0))
+#endif
 
-	case SET_READ_TRANSFER_DONE:
-		reg_write(this, PCIEP_READ_TRANSFER_DONE, 0xef);
-		return 0;
+/* aio only, without IOCB_AIO_RW its kiocbs look like io_uring's */
+#ifdef IOCB_AIO_RW
+#define pciep_set_cancel_fn(iocb, fn)	kiocb_set_cancel_fn(iocb, fn)
+#else
+#define pciep_set_cancel_fn(iocb, fn)	do { } while (0)
+#endif
 
-	case SET_WRITE_TRANSFER_DONE:
-		reg_write(this, PCIEP_WRITE_TRANSFER_DONE, 0xef);
-		return 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define pciep_get_unmapped_area(...)	\
+	mm_get_unmapped_area(current->mm, __VA_ARGS__)
+#else
+#define pciep_get_unmapped_area(...)	\
+	current->mm->get_unmapped_area(__VA_ARGS__)
+#endif
 
-	case CLR_READ_TRANSFER_DONE:
-		reg_write(this, PCIEP_READ_TRANSFER_DONE, 0x00);
-		return 0;
+/**
+ * pciep_import_free() - Release an imported dma-buf.
+ * @buf:	Import no longer referenced by any path.
+ */
+static void pciep_import_free(struct pciep_buffer *buf)
+{
+	pciep_dma_buf_unmap(buf->attach, buf->sgt, buf->dma_dir);
+	dma_buf_detach(buf->dmabuf, buf->attach);
+	dma_buf_put(buf->dmabuf);
+	kfree(buf);
+}
 
-	case CLR_WRITE_TRANSFER_DONE:
-		reg_write(this, PCIEP_WRITE_TRANSFER_DONE, 0x00);
-		return 0;
 
-	case GET_FPS:
-		value = reg_read(this, PCIRC_USECASE_MODE);
-		value = (value >> FPS_SHIFT) & FPS_MASK;
-		ret = copy_to_user((u32 *) arg, &value, sizeof(value));
-		return ret;
+/**
+ * pciep_placement_dev() - Device new buffers are allocated from.
+ * @this:	Pointer to the pciep driver data structure.
+ * Return:	The PL DDR device or the default DMA device.
+ */
+static struct device *pciep_placement_dev(struct pciep_driver_data *this)
+{
+	if (READ_ONCE(this->placement) == BUF_PLACEMENT_PL)
+		return this->pl_dev;
+	return this->dma_dev;
+}
 
-	case GET_FORMAT:
-		value = reg_read(this, PCIRC_USECASE_MODE);
-		value = (value >> FORMAT_SHIFT) & FORMAT_MASK;
-		ret = copy_to_user((u32 *) arg, &value, sizeof(value));
-		return ret;
+/**
+ * pciep_pool_free() - Free the buffers of a pool.
+ * @this:	Pointer to the pciep driver data structure.
+ * @bufs:	Pool returned by pciep_pool_alloc().
+ */
+static void pciep_pool_free(struct pciep_driver_data *this,
+			    struct pciep_buffer *bufs)
+{
+	u32 i;
 
-	default:
-		return -ENOTTY;
+	for (i = 0; i < this->num_bufs; i++) {
+		struct pciep_buffer *buf = &bufs[i];
+
+		if (!buf->virt_addr)
+			continue;
+		if (buf->cached)
+			dma_free_pages(buf->dev, buf->size,
+				       virt_to_page(buf->virt_addr),
+				       buf->phys_addr, buf->dma_dir);
+		else
+			dma_free_coherent(buf->dev, buf->size,
+					  buf->virt_addr, buf->phys_addr);
 	}
+	kfree(bufs);
 }
 
 /**
- * pciep_driver_file_read() - This is the driver read function.
- * @file:	Pointer to the file structure.
- * @buff:	Pointer to the user buffer.
- * @count:	The number of bytes to be written.
- * @ppos:	Pointer to the offset value.
- * Return:	Transferred size.
+ * pciep_pool_alloc() - Allocate the buffers of a pool.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path the pool is for.
+ * @dev:	Device to allocate the buffers from.
+ * @cache:	BUF_CACHE_UNCACHED or BUF_CACHE_STREAMING.
+ * Return:	Pointer to the pool or NULL.
+ *
+ * Streaming buffers are plain cached pages, physically contiguous and
+ * naturally aligned when they come from the page allocator, which lets
+ * large buffers be mapped to userspace with 2MB pages. The PL DDR region
+ * is a coherent pool only, its buffers are never streaming.
  */
-static ssize_t pciep_driver_file_read(struct file *file, char __user *buff,
-				      size_t count, loff_t *ppos)
+static struct pciep_buffer *pciep_pool_alloc(struct pciep_driver_data *this,
+					     struct pciep_path *path,
+					     struct device *dev, u32 cache)
 {
-	struct pciep_driver_data *this = file->private_data;
-	u32 value;
-	int ret;
+	bool cached = cache == BUF_CACHE_STREAMING && dev == this->dma_dev;
+	struct pciep_buffer *bufs;
+	struct page *page;
+	u32 i;
 
-	/* check the size */
-	if (count <= 0)
-		return -EINVAL;
+	bufs = kcalloc(this->num_bufs, sizeof(*bufs), GFP_KERNEL);
+	if (!bufs)
+		return NULL;
 
-	/* allocate the buffer based on the size from applcation */
-	this->read_virt_addr = dma_alloc_coherent(this->dma_dev, count,
-					     &(this->read_phys_addr), GFP_KERNEL);
-	if (IS_ERR_OR_NULL(this->read_virt_addr)) {
-		dev_err(this->dma_dev, "%s dma_alloc_coherent() failed\n",
-			__func__);
-		this->read_virt_addr = NULL;
-		return -ENOMEM;
+	for (i = 0; i < this->num_bufs; i++) {
+		struct pciep_buffer *buf = &bufs[i];
+
+		buf->index = i;
+		buf->pooled = true;
+		buf->size = this->size;
+		buf->dev = dev;
+		buf->cached = cached;
+		buf->dma_dir = pciep_is_write(this, path) ? DMA_TO_DEVICE :
+							    DMA_FROM_DEVICE;
+		if (cached) {
+			page = dma_alloc_pages(dev, buf->size, &buf->phys_addr,
+					       buf->dma_dir, GFP_KERNEL);
+			buf->virt_addr = page ? page_address(page) : NULL;
+		} else {
+			buf->virt_addr = dma_alloc_coherent(dev, buf->size,
+							    &buf->phys_addr,
+							    GFP_KERNEL);
+		}
+		if (!buf->virt_addr) {
+			dev_err(this->dma_dev,
+				"%s pool buffer %u allocation failed\n",
+				path->name, i);
+			pciep_pool_free(this, bufs);
+			return NULL;
+		}
 	}
 
-	reg_write(this, PCIEP_READ_BUFFER_ADDR, this->read_phys_addr);
-	reg_write(this, PCIEP_READ_BUFFER_SIZE, count);
-	value = reg_read(this, PCIEP_READ_BUFFER_READY);
-	value |= SET_BUFFER_RDY;
-	reg_write(this, PCIEP_READ_BUFFER_READY, value);
+	return bufs;
+}
+
+/**
+ * pciep_buffer_sync() - Hand part of a cached buffer over.
+ * @buf:	Buffer to hand over.
+ * @offset:	Start of the range in the buffer.
+ * @len:	No.of bytes the CPU or the endpoint accesses.
+ * @for_cpu:	Hand the range over to the CPU rather than the endpoint.
+ *
+ * Coherent buffers need no hand over, and neither do cached ones on a
+ * dma-coherent endpoint, where the syncs do nothing.
+ */
+static void pciep_buffer_sync(struct pciep_buffer *buf, size_t offset,
+			      size_t len, bool for_cpu)
+{
+	if (!buf->cached || !len)
+		return;
+	if (for_cpu)
+		dma_sync_single_range_for_cpu(buf->dev, buf->phys_addr, offset,
+					      len, buf->dma_dir);
+	else
+		dma_sync_single_range_for_device(buf->dev, buf->phys_addr,
+						 offset, len, buf->dma_dir);
+}
 
-	/* wait for done event */
-	wait_for_completion(&this->read_complete);
+/**
+ * pciep_dio_free() - Release the user pages of a direct I/O transfer.
+ * @dio:	Transfer whose chunks are out of the ring.
+ */
+static void pciep_dio_free(struct pciep_dio *dio)
+{
+	dma_unmap_sgtable(dio->dev, &dio->sgt, dio->dir, 0);
+	sg_free_table(&dio->sgt);
+	unpin_user_pages_dirty_lock(dio->pages, dio->pinned,
+				    dio->dir == DMA_FROM_DEVICE);
+	kvfree(dio->pages);
+	kfree(dio->chunks);
+	kfree(dio);
+}
 
-	ret = copy_to_user(buff, this->read_virt_addr, count);
+static void pciep_dio_reclaim(struct work_struct *work)
+{
+	struct pciep_path *path = container_of(work, struct pciep_path,
+					       dio_work);
+	struct pciep_dio *dio, *tmp;
+	unsigned long flags;
+	LIST_HEAD(retired);
 
-	/* free up the allocated memory */
-	dma_free_coherent(this->dma_dev, count,
-                 this->read_virt_addr, this->read_phys_addr);
+	spin_lock_irqsave(&path->lock, flags);
+	list_splice_init(&path->dio_retired, &retired);
+	spin_unlock_irqrestore(&path->lock, flags);
 
-	return ret;
+	list_for_each_entry_safe(dio, tmp, &retired, list)
+		pciep_dio_free(dio);
 }
 
 /**
- * pciep_driver_file_write() - This is the driver write function.
- * @file:	Pointer to the file structure.
- * @buff:	Pointer to the user buffer.
- * @count:	The number of bytes to be written.
- * @ppos:	Pointer to the offset value
- * Return:	Transferred size.
+ * __pciep_dio_release() - Release the held direct I/O transfers.
+ * @path:	Path the host is known to be done with the withdrawn chunks
+ *		of.
+ *
+ * The endpoint runs one transfer at a time, past the next transfer done
+ * interrupt or a reset nothing touches the withdrawn chunks anymore.
+ * Called with path->lock held.
  */
-static ssize_t pciep_driver_file_write(struct file *file,
-				       const char __user *buff,
-				       size_t count, loff_t *ppos)
+static void __pciep_dio_release(struct pciep_path *path)
 {
-	struct pciep_driver_data *this = file->private_data;
-	int ret;
-	u32 value;
-
-	/* check the size */
-	if (count <= 0)
-		return -EINVAL;
+	if (list_empty(&path->dio_held))
+		return;
+	list_splice_tail_init(&path->dio_held, &path->dio_retired);
+	schedule_work(&path->dio_work);
+}
 
-	/* dma buffer allocation */
-	this->write_virt_addr = dma_alloc_coherent(this->dma_dev, count,
-					     &(this->write_phys_addr), GFP_KERNEL);
-	if (IS_ERR_OR_NULL(this->write_virt_addr)) {
-		dev_err(this->dma_dev, "%s dma_alloc_coherent() failed\n",
-			__func__);
-		this->write_virt_addr = NULL;
-		return -ENOMEM;
-	}
+/**
+ * pciep_path_quiesce() - Stop the timers and work items of a path.
+ * @path:	Path whose interrupts are gone, with nothing left in its ring.
+ */
+static void pciep_path_quiesce(struct pciep_path *path)
+{
+	unsigned long flags;
 
-	ret = copy_from_user(this->write_virt_addr, buff, count);
-	if (ret)
-		goto out;
+	hrtimer_cancel(&path->coalesce_timer);
+	hrtimer_cancel(&path->sched_timer);
+	hrtimer_cancel(&path->iocb_timer);
+	cancel_work_sync(&path->iocb_work);
+	/* the interrupts are gone, nothing completes the held transfers */
+	spin_lock_irqsave(&path->lock, flags);
+	list_splice_tail_init(&path->dio_held, &path->dio_retired);
+	spin_unlock_irqrestore(&path->lock, flags);
+	cancel_work_sync(&path->dio_work);
+	pciep_dio_reclaim(&path->dio_work);
+}
 
-	reg_write(this, PCIEP_WRITE_BUFFER_ADDR, this->write_phys_addr);
-	reg_write(this, PCIEP_WRITE_BUFFER_SIZE, count);
-	value = reg_read(this, PCIEP_WRITE_BUFFER_READY);
-	value |= SET_BUFFER_RDY;
-	reg_write(this, PCIEP_WRITE_BUFFER_READY, value);
+/**
+ * pciep_path_cleanup() - Free the buffer pool of a transfer path.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path to clean up.
+ */
+static void pciep_path_cleanup(struct pciep_driver_data *this,
+			       struct pciep_path *path)
+{
+	u32 i;
 
-	/* wait for done event */
-	wait_for_completion(&this->write_complete);
-out:
-	/* free the allocated memory */
-	dma_free_coherent(this->dma_dev, count,
-                 this->write_virt_addr, this->write_phys_addr);
+	if (!path->bufs)
+		return;
 
-	return ret;
+	pciep_path_quiesce(path);
+	pciep_pool_free(this, path->bufs);
+	for (i = 0; i < MAX_NUM_IMPORTS; i++) {
+		if (path->imports[i])
+			pciep_import_free(path->imports[i]);
+		path->imports[i] = NULL;
+	}
+	path->bufs = NULL;
+	INIT_LIST_HEAD(&path->free);
 }
 
-
-static loff_t pciep_driver_file_lseek(struct file *file,loff_t offset, int orig)
+/*
+ * Last reference gone: the device was removed and nothing uses the pools
+ * anymore, no file, mapping or exported dma-buf, see
+ * pciep_driver_destroy().
+ */
+static void pciep_driver_free(struct kref *ref)
 {
-	struct pciep_driver_data *this = file->private_data;
-	u32 value;
+	struct pciep_driver_data *this = container_of(ref,
+						      struct pciep_driver_data,
+						      ref);
 
-	reg_write(this, PCIEP_READ_BUFFER_OFFSET, offset);
-	value = reg_read(this, PCIEP_READ_BUFFER_READY);
-	value &= ~READ_BUF_HIGH_OFFSET;
-	value |= (offset >> 16) & READ_BUF_HIGH_OFFSET;
-	reg_write(this, PCIEP_READ_BUFFER_READY, value);
-	return offset;
+	pciep_path_cleanup(this, &this->write_path);
+	pciep_path_cleanup(this, &this->read_path);
+	if (this->pl_dev)
+		of_reserved_mem_device_release(this->pl_dev);
+	put_device(this->sys_dev);
+	put_device(this->dma_dev);
+	free_percpu(this->stats);
+	kfree(this);
 }
 
-static const struct file_operations pciep_driver_file_ops = {
-	.owner   = THIS_MODULE,
+/*
+ * The probe holds a reference until the removal, every open file, the
+ * V4L2 node and every exported dma-buf hold one until they are released.
+ */
+static inline void pciep_get(struct pciep_driver_data *this)
+{
+	kref_get(&this->ref);
+}
+
+static inline void pciep_put(struct pciep_driver_data *this)
+{
+	kref_put(&this->ref, pciep_driver_free);
+}
+
+static enum hrtimer_restart pciep_path_coalesce_timer(struct hrtimer *timer)
+{
+	struct pciep_path *path = container_of(timer, struct pciep_path,
+					       coalesce_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&path->lock, flags);
+	path->unreported = 0;
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	wake_up(&path->wait);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * pciep_path_init() - Allocate the buffer pool of a transfer path.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path to initialize.
+ * @name:	Direction name used in messages.
+ * @regs:	Register layout of the direction.
+ * Return:      Success(=0) or error status(<0).
+ */
+static int pciep_path_init(struct pciep_driver_data *this,
+			   struct pciep_path *path, const char *name,
+			   const struct pciep_path_regs *regs)
+{
+	u32 i;
+
+	path->name = name;
+	path->regs = regs;
+	spin_lock_init(&path->lock);
+	INIT_LIST_HEAD(&path->free);
+	INIT_LIST_HEAD(&path->queued);
+	INIT_LIST_HEAD(&path->done);
+	INIT_LIST_HEAD(&path->dio_held);
+	INIT_LIST_HEAD(&path->dio_retired);
+	INIT_WORK(&path->dio_work, pciep_dio_reclaim);
+	init_waitqueue_head(&path->wait);
+	hrtimer_init(&path->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	path->coalesce_timer.function = pciep_path_coalesce_timer;
+
+	path->bufs = pciep_pool_alloc(this, path, pciep_placement_dev(this),
+				      this->cache);
+	if (!path->bufs)
+		return -ENOMEM;
+
+	for (i = 0; i < this->num_bufs; i++)
+		list_add_tail(&path->bufs[i].list, &path->free);
+
+	return 0;
+}
+
+/**
+ * __pciep_buffer_recycle() - Hand a buffer nobody waits for back.
+ * @path:	Path the buffer belongs to.
+ * @buf:	Buffer not on any list.
+ *
+ * Pool buffers go back to the free list unless a dma-buf still exports
+ * them, mapped ones are FREE but left off the list for read()/write() not
+ * to take them, see pciep_vm_close(). Imports stay detached until
+ * pciep_import_reclaim() frees them. Called with path->lock held.
+ */
+static void __pciep_buffer_recycle(struct pciep_path *path,
+				   struct pciep_buffer *buf)
+{
+	buf->orphan = false;
+	buf->owner = NULL;
+	buf->stream = NULL;
+	buf->rw = false;
+	if (!buf->pooled || buf->exported) {
+		buf->state = PCIEP_BUF_USER;
+		return;
+	}
+	buf->state = PCIEP_BUF_FREE;
+	if (buf->mapped)
+		INIT_LIST_HEAD(&buf->list);
+	else
+		list_add_tail(&buf->list, &path->free);
+}
+
+/**
+ * pciep_buffer_take() - Take a free buffer out of the pool.
+ * @path:	Path the transfer belongs to.
+ * Return:	Pointer to the buffer or NULL if the pool is exhausted.
+ */
+static struct pciep_buffer *pciep_buffer_take(struct pciep_path *path)
+{
+	struct pciep_buffer *buf;
+	unsigned long flags;
+
+	spin_lock_irqsave(&path->lock, flags);
+	buf = list_first_entry_or_null(&path->free, struct pciep_buffer, list);
+	if (buf) {
+		list_del(&buf->list);
+		buf->state = PCIEP_BUF_USER;
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	return buf;
+}
+
+/* one-off buffer slot of a stream for the direction of a path */
+static struct pciep_buffer **pciep_stream_spare(struct pciep_stream *stream,
+						struct pciep_path *path)
+{
+	return pciep_is_write(stream->this, path) ?
+	       &stream->write_spare : &stream->read_spare;
+}
+
+/**
+ * pciep_buffer_free() - Free a one-off buffer.
+ * @buf:	Buffer not owned by a pool.
+ */
+static void pciep_buffer_free(struct pciep_buffer *buf)
+{
+	dma_free_coherent(buf->dev, buf->size, buf->virt_addr, buf->phys_addr);
+	kfree(buf);
+}
+
+/**
+ * pciep_buffer_get() - Get a DMA buffer for a transfer.
+ * @stream:	Stream the transfer is made for.
+ * @path:	Path the transfer belongs to.
+ * @count:	The number of bytes to be transferred.
+ * Return:	Pointer to the buffer or NULL.
+ *
+ * A free pool buffer is used when the transfer fits into it. Oversized
+ * transfers, or transfers arriving while the pool is exhausted, fall back
+ * to the one-off buffer the stream kept from its last such transfer, or
+ * to a new coherent allocation when that one is too small. Frames are
+ * mostly of one size, so one allocation usually serves the whole stream.
+ */
+static struct pciep_buffer *pciep_buffer_get(struct pciep_stream *stream,
+					     struct pciep_path *path,
+					     size_t count)
+{
+	struct pciep_driver_data *this = stream->this;
+	struct pciep_buffer *buf;
+
+	if (pciep_should_fail(this, fail_alloc)) {
+		this_cpu_inc(path->stats->alloc_failures);
+		return NULL;
+	}
+
+	if (count <= this->size) {
+		buf = pciep_buffer_take(path);
+		if (buf) {
+			trace_pciep_buffer_get(pciep_minor(this),
+					       pciep_is_write(this, path), true,
+					       buf->index, buf->size);
+			return buf;
+		}
+	}
+
+	/* grow only, and drop a spare left over from another placement */
+	buf = xchg(pciep_stream_spare(stream, path), NULL);
+	if (buf && buf->size >= count &&
+	    buf->dev == pciep_placement_dev(this)) {
+		buf->state = PCIEP_BUF_USER;
+		buf->orphan = false;
+		buf->stream = NULL;
+		trace_pciep_buffer_get(pciep_minor(this),
+				       pciep_is_write(this, path), false, 0,
+				       buf->size);
+		return buf;
+	}
+	if (buf)
+		pciep_buffer_free(buf);
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf) {
+		this_cpu_inc(path->stats->alloc_failures);
+		return NULL;
+	}
+
+	buf->size = PAGE_ALIGN(count);
+	buf->state = PCIEP_BUF_USER;
+	buf->dev = pciep_placement_dev(this);
+	buf->virt_addr = dma_alloc_coherent(buf->dev, buf->size,
+					    &buf->phys_addr, GFP_KERNEL);
+	if (!buf->virt_addr) {
+		dev_err(this->dma_dev, "%s dma_alloc_coherent() failed\n",
+			__func__);
+		this_cpu_inc(path->stats->alloc_failures);
+		kfree(buf);
+		return NULL;
+	}
+	trace_pciep_buffer_get(pciep_minor(this), pciep_is_write(this, path),
+			       false, 0, buf->size);
+
+	return buf;
+}
+
+/**
+ * pciep_buffer_put() - Release a DMA buffer after a transfer.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path the transfer belongs to.
+ * @buf:	Buffer returned by pciep_buffer_get().
+ */
+static void pciep_buffer_put(struct pciep_driver_data *this,
+			     struct pciep_path *path,
+			     struct pciep_buffer *buf)
+{
+	unsigned long flags;
+
+	if (!buf->pooled) {
+		pciep_buffer_free(buf);
+		return;
+	}
+
+	spin_lock_irqsave(&path->lock, flags);
+	__pciep_buffer_recycle(path, buf);
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	/* a free buffer makes the write path writable again */
+	wake_up(&path->wait);
+}
+
+/**
+ * pciep_stream_buffer_put() - Release a buffer got by pciep_buffer_get().
+ * @stream:	Stream the transfer was made for.
+ * @path:	Path the transfer belongs to.
+ * @buf:	Buffer returned by pciep_buffer_get().
+ *
+ * A one-off buffer is kept by the stream for its next oversized transfer
+ * and only freed if another one is already kept, by a concurrent caller.
+ */
+static void pciep_stream_buffer_put(struct pciep_stream *stream,
+				    struct pciep_path *path,
+				    struct pciep_buffer *buf)
+{
+	if (!buf->pooled && !cmpxchg(pciep_stream_spare(stream, path),
+				     NULL, buf))
+		return;
+
+	pciep_buffer_put(stream->this, path, buf);
+}
+
+/**
+ * pciep_path_load_shadow() - Seed the register shadows of a path.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path to seed.
+ *
+ * Done once the register space is mapped and after a reset, the only
+ * times the buffer registers are read. Called with path->lock held or
+ * before the path is used.
+ */
+static void pciep_path_load_shadow(struct pciep_driver_data *this,
+				   struct pciep_path *path)
+{
+	path->shadow_ready = reg_read(this, path->regs->ready);
+	path->shadow_offset = reg_read(this, path->regs->offset);
+	path->shadow_addr_high = reg_read(this, path->regs->addr_high);
+}
+
+/**
+ * pciep_path_restore_shadow() - Write the register shadows of a path back.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Idle path to restore.
+ *
+ * The register block may lose its state while runtime suspended.
+ */
+static void pciep_path_restore_shadow(struct pciep_driver_data *this,
+				      struct pciep_path *path)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&path->lock, flags);
+	reg_write_relaxed(this, path->regs->offset, path->shadow_offset);
+	reg_write_relaxed(this, path->regs->addr_high, path->shadow_addr_high);
+	reg_write(this, path->regs->ready, path->shadow_ready);
+	spin_unlock_irqrestore(&path->lock, flags);
+}
+
+/**
+ * pciep_path_write_offset() - Write a host offset to the endpoint.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path the offset belongs to.
+ * @offset:	Host offset.
+ * @ready:	Set the buffer ready flag in the same register write.
+ *
+ * Registers already holding the value are not written again. The ready
+ * register is written last and with a barrier, so that everything the
+ * transfer depends on reaches the endpoint before it starts. Called with
+ * path->lock held.
+ */
+static void pciep_path_write_offset(struct pciep_driver_data *this,
+				    struct pciep_path *path, u64 offset,
+				    bool ready)
+{
+	u32 value;
+
+	if (lower_32_bits(offset) != path->shadow_offset) {
+		reg_write_relaxed(this, path->regs->offset, offset);
+		path->shadow_offset = lower_32_bits(offset);
+	}
+	value = path->shadow_ready & ~path->regs->high_offset_mask;
+	value |= (offset >> 16) & path->regs->high_offset_mask;
+	if (ready)
+		value |= SET_BUFFER_RDY;
+	if (ready || value != path->shadow_ready)
+		reg_write(this, path->regs->ready, value);
+	path->shadow_ready = value;
+}
+
+/**
+ * pciep_path_set_offset() - Write a host offset to an idle path.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path the offset belongs to.
+ * @offset:	Host offset.
+ *
+ * The offset is written to the endpoint right away when the path is idle,
+ * else it is left alone so that the transfer in flight is not disturbed;
+ * every queued buffer carries its own offset anyway.
+ */
+static void pciep_path_set_offset(struct pciep_driver_data *this,
+				  struct pciep_path *path, u64 offset)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&path->lock, flags);
+	if (!path->active)
+		pciep_path_write_offset(this, path, offset, false);
+	spin_unlock_irqrestore(&path->lock, flags);
+}
+
+/**
+ * pciep_stream_offset() - Host offset of a stream on a path.
+ * @stream:	Stream context of the file.
+ * @path:	Path the offset belongs to.
+ * Return:	Pointer to the offset of the next transfer.
+ */
+static u64 *pciep_stream_offset(struct pciep_stream *stream,
+				struct pciep_path *path)
+{
+	if (path == &stream->this->write_path)
+		return &stream->write_offset;
+	return &stream->read_offset;
+}
+
+/**
+ * pciep_stream_set_offset() - Set the host offset of the next transfers.
+ * @stream:	Stream context of the file.
+ * @path:	Path the offset belongs to.
+ * @offset:	Host offset.
+ */
+static void pciep_stream_set_offset(struct pciep_stream *stream,
+				    struct pciep_path *path, u64 offset)
+{
+	WRITE_ONCE(*pciep_stream_offset(stream, path), offset);
+	trace_pciep_set_offset(pciep_minor(stream->this),
+			       pciep_is_write(stream->this, path), offset);
+	pciep_path_set_offset(stream->this, path, offset);
+}
+
+/**
+ * pciep_path_program() - Program a buffer into the endpoint.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path the transfer belongs to.
+ * @buf:	Buffer to transfer.
+ *
+ * Address, size and offset go out as one batch of relaxed writes, closed
+ * by the ready write which carries the only barrier. Called with
+ * path->lock held.
+ */
+static void pciep_path_program(struct pciep_driver_data *this,
+			       struct pciep_path *path,
+			       struct pciep_buffer *buf)
+{
+	u32 high = upper_32_bits(buf->phys_addr);
+
+	path->active = buf;
+	if (high != path->shadow_addr_high) {
+		reg_write_relaxed(this, path->regs->addr_high, high);
+		path->shadow_addr_high = high;
+	}
+	reg_write_relaxed(this, path->regs->addr,
+			  lower_32_bits(buf->phys_addr));
+	reg_write_relaxed(this, path->regs->size, buf->bytesused);
+	pciep_path_write_offset(this, path, buf->offset, true);
+	trace_pciep_buffer_ready(pciep_minor(this), pciep_is_write(this, path),
+				 buf->phys_addr, buf->bytesused, buf->offset);
+}
+
+/**
+ * __pciep_path_pick() - Choose the queued buffer to program next.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path whose endpoint is idle.
+ * Return:	The buffer, still on the queued list, or NULL.
+ *
+ * The transfers of a stream complete in the order they were queued, so
+ * only the oldest queued buffer of each stream is a candidate. The most
+ * urgent class wins, within a class the stream furthest behind its
+ * weighted share, ties going to the oldest buffer. Streams over their
+ * bandwidth cap sit the round out and the scheduling timer comes back
+ * once the first of them may go again. Buffers left queued by closed
+ * files form one uncapped stream of their own. Called with path->lock
+ * held.
+ */
+static struct pciep_buffer *__pciep_path_pick(struct pciep_driver_data *this,
+					      struct pciep_path *path)
+{
+	unsigned int dir = pciep_is_write(this, path);
+	struct pciep_buffer *buf, *best = NULL;
+	struct pciep_stream_sched *sched;
+	ktime_t now = ktime_get();
+	ktime_t wake = KTIME_MAX;
+	bool orphans = false;
+	u64 vtime, best_vtime = 0;
+
+	path->sched_gen++;
+	list_for_each_entry(buf, &path->queued, list) {
+		if (!buf->stream) {
+			if (orphans)
+				continue;
+			orphans = true;
+			vtime = path->vtime;
+		} else {
+			sched = &buf->stream->sched[dir];
+			if (sched->gen == path->sched_gen)
+				continue;
+			sched->gen = path->sched_gen;
+			if (ktime_before(now, sched->next)) {
+				if (ktime_before(sched->next, wake))
+					wake = sched->next;
+				continue;
+			}
+			vtime = max(sched->vtime, path->vtime);
+		}
+		if (!best || buf->qos_class < best->qos_class ||
+		    (buf->qos_class == best->qos_class && vtime < best_vtime)) {
+			best = buf;
+			best_vtime = vtime;
+		}
+	}
+
+	if (!best && wake != KTIME_MAX)
+		hrtimer_start(&path->sched_timer, wake, HRTIMER_MODE_ABS);
+
+	return best;
+}
+
+/**
+ * __pciep_path_charge() - Account a buffer about to be programmed.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path the transfer belongs to.
+ * @buf:	Buffer picked by __pciep_path_pick().
+ *
+ * Advances the virtual time of the stream by the size of the transfer
+ * over its weight and pushes its next start out by the time the transfer
+ * takes at the capped rate. Called with path->lock held.
+ */
+static void __pciep_path_charge(struct pciep_driver_data *this,
+				struct pciep_path *path,
+				struct pciep_buffer *buf)
+{
+	struct pciep_stream *stream = buf->stream;
+	struct pciep_stream_sched *sched;
+	ktime_t now = ktime_get();
+	u64 rate;
+
+	this_cpu_inc(path->stats->qos_transfers[buf->qos_class]);
+	this_cpu_add(path->stats->qos_delay_ns[buf->qos_class],
+		     ktime_to_ns(ktime_sub(now, buf->submitted)));
+	if (!stream)
+		return;
+
+	sched = &stream->sched[pciep_is_write(this, path)];
+	path->vtime = max(sched->vtime, path->vtime);
+	sched->vtime = path->vtime +
+		       div_u64((u64)buf->bytesused * QOS_WEIGHT_DEFAULT,
+			       READ_ONCE(stream->qos_weight));
+
+	rate = READ_ONCE(stream->qos_rate);
+	if (rate) {
+		if (ktime_before(sched->next, now))
+			sched->next = now;
+		sched->next = ktime_add_ns(sched->next,
+				div64_u64((u64)buf->bytesused * NSEC_PER_SEC,
+					  rate));
+	}
+}
+
+/**
+ * __pciep_path_next() - Program the next queued buffer, if any.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path whose endpoint just went idle.
+ *
+ * Called with path->lock held.
+ */
+static void __pciep_path_next(struct pciep_driver_data *this,
+			      struct pciep_path *path)
+{
+	struct pciep_buffer *buf;
+
+	buf = __pciep_path_pick(this, path);
+	if (buf) {
+		list_del(&buf->list);
+		__pciep_path_charge(this, path, buf);
+		pciep_path_program(this, path, buf);
+	}
+}
+
+static enum hrtimer_restart pciep_path_sched_timer(struct hrtimer *timer)
+{
+	struct pciep_path *path = container_of(timer, struct pciep_path,
+					       sched_timer);
+	struct pciep_driver_data *this = pciep_path_to_this(path);
+	unsigned long flags;
+
+	spin_lock_irqsave(&path->lock, flags);
+	if (!path->active)
+		__pciep_path_next(this, path);
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/* set up before the pools, pciep_path_cleanup() cancels it */
+static void pciep_path_sched_init(struct pciep_path *path)
+{
+	hrtimer_init(&path->sched_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	path->sched_timer.function = pciep_path_sched_timer;
+}
+
+/**
+ * __pciep_iocb_done() - Complete the kiocb a pool buffer was queued for.
+ * @path:	Path the transfer belongs to.
+ * @buf:	Buffer out of the ring.
+ * @res:	Transferred size or error status(<0).
+ *
+ * The buffer goes back to the pool before the caller hears of it, so a
+ * resubmission from the completion finds it free. Called with path->lock
+ * held, from the interrupt thread or from a cancel.
+ */
+static void __pciep_iocb_done(struct pciep_path *path,
+			      struct pciep_buffer *buf, long res)
+{
+	struct kiocb *iocb = buf->iocb;
+
+	if (res > 0 && buf->dma_dir == DMA_FROM_DEVICE)
+		pciep_buffer_sync(buf, 0, res, true);
+	buf->iocb = NULL;
+	buf->complete = NULL;
+	__pciep_buffer_recycle(path, buf);
+	pciep_ki_complete(iocb, res);
+
+	/* a free buffer makes the write path writable again */
+	wake_up(&path->wait);
+}
+
+/**
+ * __pciep_buffer_drop() - Hand back a buffer taken out of the ring.
+ * @path:	Path the transfer belongs to.
+ * @buf:	Buffer in the USER state, not on any list.
+ * @res:	Error status(<0) an asynchronous transfer completes with.
+ *
+ * Buffers nobody waits for go back to the pool, those of QUEUE_BUF and
+ * of blocked read()/write() calls stay with their owner. Called with
+ * path->lock held.
+ */
+static void __pciep_buffer_drop(struct pciep_path *path,
+				struct pciep_buffer *buf, long res)
+{
+	if (buf->iocb)
+		__pciep_iocb_done(path, buf, res);
+	else if (buf->rw || buf->orphan)
+		__pciep_buffer_recycle(path, buf);
+}
+
+/**
+ * __pciep_path_pm() - Keep the endpoint resumed while a path is busy.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path that may have started or gone idle.
+ *
+ * The reference is taken without resuming, whoever queues a transfer
+ * holds one already, and dropped with an autosuspend once the last one
+ * completes. Transfers held back by a bandwidth cap count as busy, the
+ * scheduling timer programs them later. Called with path->lock held.
+ */
+static void __pciep_path_pm(struct pciep_driver_data *this,
+			    struct pciep_path *path)
+{
+	bool busy = path->active || !list_empty(&path->queued);
+
+	if (busy == path->pm_busy)
+		return;
+	path->pm_busy = busy;
+	if (busy)
+		pm_runtime_get_noresume(this->dma_dev);
+	else
+		__pciep_pm_put(this);
+}
+
+/**
+ * __pciep_path_queue() - Add a buffer to the ring of a path.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path the transfer belongs to.
+ * @buf:	Buffer owned by the caller.
+ * @stream:	Stream the transfer is queued for.
+ * @count:	The number of bytes to be transferred.
+ * @offset:	Host offset of the transfer.
+ *
+ * The buffer is programmed right away when the endpoint is idle and the
+ * scheduler picks it, else it is started by the interrupt handler or the
+ * scheduling timer once its turn comes. Once the device is removed it is
+ * dropped as if aborted. Called with path->lock held.
+ */
+static void __pciep_path_queue(struct pciep_driver_data *this,
+			       struct pciep_path *path,
+			       struct pciep_buffer *buf,
+			       struct pciep_stream *stream, size_t count,
+			       u64 offset)
+{
+	if (READ_ONCE(this->dead)) {
+		buf->state = PCIEP_BUF_USER;
+		__pciep_buffer_drop(path, buf, -ENODEV);
+		return;
+	}
+	buf->state = PCIEP_BUF_QUEUED;
+	buf->withdrawn = false;
+	buf->stream = stream;
+	buf->bytesused = count;
+	buf->offset = offset;
+	buf->submitted = ktime_get();
+	buf->qos_class = READ_ONCE(stream->qos_class);
+	list_add_tail(&buf->list, &path->queued);
+	if (!path->active)
+		__pciep_path_next(this, path);
+	__pciep_path_pm(this, path);
+}
+
+static void pciep_path_queue(struct pciep_driver_data *this,
+			     struct pciep_path *path,
+			     struct pciep_buffer *buf,
+			     struct pciep_stream *stream, size_t count,
+			     u64 offset)
+{
+	unsigned long flags;
+
+	/* the driver's own transfers hand cached buffers over themselves */
+	pciep_buffer_sync(buf, 0, count, false);
+
+	spin_lock_irqsave(&path->lock, flags);
+	__pciep_path_queue(this, path, buf, stream, count, offset);
+	spin_unlock_irqrestore(&path->lock, flags);
+}
+
+/**
+ * pciep_path_queue_chunks() - Queue the chunks of one transfer.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path the transfer belongs to.
+ * @chunks:	Chunk descriptors, one per DMA segment.
+ * @stream:	Stream the transfer is queued for.
+ * @nents:	No.of chunks.
+ * @offset:	Host offset of the first chunk.
+ *
+ * The endpoint takes a single address per transfer, so a scattered
+ * buffer is sent as back to back transfers whose host offsets follow
+ * each other. The chunks are queued under one lock hold to keep them
+ * adjacent in the ring.
+ */
+static void pciep_path_queue_chunks(struct pciep_driver_data *this,
+				    struct pciep_path *path,
+				    struct pciep_buffer *chunks,
+				    struct pciep_stream *stream,
+				    unsigned int nents, u64 offset)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&path->lock, flags);
+	for (i = 0; i < nents; i++) {
+		__pciep_path_queue(this, path, &chunks[i], stream,
+				   chunks[i].size, offset);
+		offset += chunks[i].size;
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+}
+
+/**
+ * __pciep_path_coalesce() - Account a completion for the waiters.
+ * @path:	Path whose transfer completed.
+ * Return:	Whether the waiters have to be woken up now.
+ *
+ * Called with path->lock held. The endpoint interrupts once per transfer
+ * since the next buffer is programmed from the interrupt, what can be
+ * coalesced are the wake ups: they happen once coalesce_frames
+ * completions gathered, when the ring runs dry, or coalesce_usecs after
+ * the first unreported completion at the latest.
+ */
+static bool __pciep_path_coalesce(struct pciep_path *path)
+{
+	unsigned int frames = READ_ONCE(coalesce_frames);
+	unsigned int usecs = READ_ONCE(coalesce_usecs);
+
+	if (++path->unreported < frames && usecs && path->active) {
+		if (path->unreported == 1)
+			hrtimer_start(&path->coalesce_timer, us_to_ktime(usecs),
+				      HRTIMER_MODE_REL);
+		return false;
+	}
+
+	path->unreported = 0;
+	hrtimer_try_to_cancel(&path->coalesce_timer);
+	return true;
+}
+
+/**
+ * pciep_path_account() - Account a completed transfer.
+ * @path:	Path the transfer belongs to.
+ * @buf:	Buffer just retired.
+ */
+static void pciep_path_account(struct pciep_path *path,
+			       struct pciep_buffer *buf)
+{
+	s64 us = ktime_us_delta(buf->completed, buf->submitted);
+	unsigned int bucket = 0;
+
+	if (us > 0)
+		bucket = min_t(unsigned int, ilog2(us) + 1,
+			       PCIEP_LATENCY_BUCKETS - 1);
+
+	this_cpu_inc(path->stats->transfers);
+	this_cpu_add(path->stats->bytes, buf->bytesused);
+	this_cpu_inc(path->stats->latency[bucket]);
+}
+
+/**
+ * pciep_path_clear_ready() - Clear the buffer ready flag of a path.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path to clear.
+ *
+ * Called with path->lock held.
+ */
+static void pciep_path_clear_ready(struct pciep_driver_data *this,
+				   struct pciep_path *path)
+{
+	path->shadow_ready &= ~SET_BUFFER_RDY;
+	reg_write(this, path->regs->ready, path->shadow_ready);
+}
+
+/**
+ * pciep_path_retire() - Retire the active buffer of a path.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path whose transfer completed.
+ *
+ * Called from the transfer done interrupt. Moves the active buffer to the
+ * done list and programs the next queued one, if any.
+ */
+static void pciep_path_retire(struct pciep_driver_data *this,
+			      struct pciep_path *path)
+{
+	struct pciep_buffer *buf;
+	unsigned long flags;
+	ktime_t host_done;
+	bool wake;
+
+	spin_lock_irqsave(&path->lock, flags);
+	pciep_path_clear_ready(this, path);
+
+	buf = path->active;
+	path->active = NULL;
+	if (buf) {
+		host_done = READ_ONCE(this->host_done_time);
+		buf->completed = READ_ONCE(path->irq_time);
+		buf->host_done = ktime_after(host_done, buf->submitted) ?
+				 host_done : 0;
+		trace_pciep_transfer_done(pciep_minor(this),
+					  pciep_is_write(this, path),
+					  buf->phys_addr, buf->bytesused,
+					  buf->offset);
+		pciep_path_account(path, buf);
+		if (buf->orphan) {
+			__pciep_buffer_recycle(path, buf);
+		} else if (buf->complete) {
+			buf->state = PCIEP_BUF_USER;
+			buf->complete(buf);
+		} else {
+			buf->state = PCIEP_BUF_DONE;
+			list_add_tail(&buf->list, &path->done);
+		}
+	}
+	__pciep_dio_release(path);
+
+	__pciep_path_next(this, path);
+	__pciep_path_pm(this, path);
+	wake = __pciep_path_coalesce(path);
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	if (wake)
+		wake_up(&path->wait);
+}
+
+/**
+ * __pciep_path_abort() - Take a queued buffer back from the endpoint.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path the transfer belongs to.
+ * @buf:	Queued buffer.
+ *
+ * A buffer still waiting in the ring is simply unlinked. The active one
+ * is withdrawn by clearing the buffer ready flag the host checks before
+ * each transfer, and the ring moves on to the next buffer. The host may
+ * have started the transfer already, the buffer is marked withdrawn. It
+ * is left in the USER state. Called with path->lock held.
+ */
+static void __pciep_path_abort(struct pciep_driver_data *this,
+			       struct pciep_path *path,
+			       struct pciep_buffer *buf)
+{
+	trace_pciep_transfer_abort(pciep_minor(this),
+				   pciep_is_write(this, path),
+				   buf->phys_addr, buf->bytesused, buf->offset);
+	this_cpu_inc(path->stats->aborted);
+	buf->state = PCIEP_BUF_USER;
+	if (buf != path->active) {
+		list_del(&buf->list);
+		__pciep_path_pm(this, path);
+		return;
+	}
+
+	pciep_path_clear_ready(this, path);
+	buf->withdrawn = true;
+	path->active = NULL;
+	__pciep_path_next(this, path);
+	__pciep_path_pm(this, path);
+}
+
+/**
+ * pciep_path_wait() - Wait for buffers queued by read()/write().
+ * @stream:	Stream the buffers were queued for.
+ * @path:	Path the transfer belongs to.
+ * @bufs:	Array of buffers passed to pciep_path_queue() or
+ *		pciep_path_queue_chunks().
+ * @nents:	No.of buffers in @bufs.
+ * Return:	Success(=0) or error status(<0).
+ *
+ * With busy_poll_usecs set the caller first spins on the buffer state,
+ * saving the sleep and wake up for transfers completing within that time.
+ * The wait ends early on a signal, on the deadline of the stream or when
+ * the stream is cancelled; the buffers are then taken back from the
+ * endpoint and can be freed or recycled by the caller.
+ */
+static int pciep_path_wait(struct pciep_stream *stream,
+			   struct pciep_path *path, struct pciep_buffer *bufs,
+			   unsigned int nents)
+{
+	/* the ring completes in order, the last buffer is done last */
+	struct pciep_buffer *last = &bufs[nents - 1];
+	unsigned int usecs = READ_ONCE(busy_poll_usecs);
+	unsigned int msecs = READ_ONCE(stream->timeout_ms);
+	long timeout = msecs ? msecs_to_jiffies(msecs) : MAX_SCHEDULE_TIMEOUT;
+	ktime_t start = ktime_get();
+	unsigned long flags;
+	unsigned int i;
+	long ret;
+
+	if (usecs) {
+		ktime_t end = ktime_add_us(ktime_get(), usecs);
+
+		while (READ_ONCE(last->state) == PCIEP_BUF_QUEUED &&
+		       ktime_before(ktime_get(), end))
+			cpu_relax();
+	}
+	/* a cancel moves the buffers out of QUEUED without completing them */
+	ret = wait_event_interruptible_timeout(path->wait,
+			READ_ONCE(last->state) != PCIEP_BUF_QUEUED, timeout);
+	this_cpu_add(path->stats->wait_ns,
+		     ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	spin_lock_irqsave(&path->lock, flags);
+	if (last->state == PCIEP_BUF_DONE)
+		ret = 0;
+	else if (last->state == PCIEP_BUF_USER)
+		ret = READ_ONCE(stream->this->dead) ? -ENODEV : -ECANCELED;
+	else if (ret >= 0)
+		ret = -ETIMEDOUT;
+	/* last to first, aborting the active chunk programs none of ours */
+	for (i = nents; i-- > 0; ) {
+		if (bufs[i].state == PCIEP_BUF_QUEUED)
+			__pciep_path_abort(stream->this, path, &bufs[i]);
+		else if (bufs[i].state == PCIEP_BUF_DONE)
+			list_del(&bufs[i].list);
+		bufs[i].state = PCIEP_BUF_USER;
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	return ret;
+}
+
+/**
+ * pciep_path_dequeue() - Take the oldest completed buffer of a file.
+ * @path:	Path to look at.
+ * @file:	File that queued the buffers.
+ * @rw:		Look for buffers queued by read()/write() instead of QUEUE_BUF.
+ * @pending:	Returns whether the file still has buffers in flight.
+ * Return:	The completed buffer or NULL.
+ */
+static struct pciep_buffer *pciep_path_dequeue(struct pciep_path *path,
+					       struct file *file, bool rw,
+					       bool *pending)
+{
+	struct pciep_buffer *buf, *found = NULL;
+	unsigned long flags;
+
+	*pending = false;
+
+	spin_lock_irqsave(&path->lock, flags);
+	list_for_each_entry(buf, &path->done, list) {
+		if (buf->owner == file && buf->rw == rw) {
+			found = buf;
+			break;
+		}
+	}
+	if (found) {
+		list_del(&found->list);
+		found->state = PCIEP_BUF_USER;
+	} else if (path->active && path->active->owner == file &&
+		   path->active->rw == rw) {
+		*pending = true;
+	} else {
+		list_for_each_entry(buf, &path->queued, list) {
+			if (buf->owner == file && buf->rw == rw) {
+				*pending = true;
+				break;
+			}
+		}
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	return found;
+}
+
+/**
+ * pciep_path_dequeue_wait() - Wait for the oldest completed buffer of a file.
+ * @path:	Path to look at.
+ * @file:	File that queued the buffers.
+ * @rw:		Look for buffers queued by read()/write() instead of QUEUE_BUF.
+ * @bufp:	Returns the completed buffer, NULL if nothing is in flight.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * Blocks unless the file is non-blocking, for the deadline of the stream
+ * at most.
+ */
+static int pciep_path_dequeue_wait(struct pciep_path *path, struct file *file,
+				   bool rw, struct pciep_buffer **bufp)
+{
+	struct pciep_stream *stream = file->private_data;
+	unsigned int msecs = READ_ONCE(stream->timeout_ms);
+	struct pciep_buffer *buf = NULL;
+	ktime_t start;
+	bool pending;
+	long ret;
+
+	if (file->f_flags & O_NONBLOCK) {
+		*bufp = pciep_path_dequeue(path, file, rw, &pending);
+		return !*bufp && pending ? -EAGAIN : 0;
+	}
+
+	start = ktime_get();
+	ret = wait_event_interruptible_timeout(path->wait,
+		(buf = pciep_path_dequeue(path, file, rw, &pending)) ||
+		!pending,
+		msecs ? msecs_to_jiffies(msecs) : MAX_SCHEDULE_TIMEOUT);
+	this_cpu_add(path->stats->wait_ns,
+		     ktime_to_ns(ktime_sub(ktime_get(), start)));
+	if (ret < 0)
+		return ret;
+	if (!ret)
+		return -ETIMEDOUT;
+
+	*bufp = buf;
+	return 0;
+}
+
+/**
+ * pciep_path_poll() - Check the readiness of a path for a file.
+ * @path:	Path to look at.
+ * @file:	File being polled.
+ * @free:	Also report a free pool buffer as ready.
+ * Return:	Whether a completed buffer of the file, or a free buffer when
+ *		@free is set, is available.
+ */
+static bool pciep_path_poll(struct pciep_path *path, struct file *file,
+			    bool free)
+{
+	struct pciep_buffer *buf;
+	unsigned long flags;
+	bool ready;
+
+	spin_lock_irqsave(&path->lock, flags);
+	ready = free && !list_empty(&path->free);
+	list_for_each_entry(buf, &path->done, list) {
+		if (ready)
+			break;
+		if (buf->owner == file)
+			ready = true;
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	return ready;
+}
+
+/**
+ * pciep_import_reclaim() - Free the detached imports of a path.
+ * @path:	Path to clean up.
+ */
+static void pciep_import_reclaim(struct pciep_path *path)
+{
+	struct pciep_buffer *buf;
+	unsigned long flags;
+	LIST_HEAD(detached);
+	u32 i;
+
+	spin_lock_irqsave(&path->lock, flags);
+	for (i = 0; i < MAX_NUM_IMPORTS; i++) {
+		buf = path->imports[i];
+		if (!buf || buf->owner || buf->state != PCIEP_BUF_USER)
+			continue;
+		path->imports[i] = NULL;
+		list_add_tail(&buf->list, &detached);
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	while ((buf = list_first_entry_or_null(&detached, struct pciep_buffer,
+					       list))) {
+		list_del(&buf->list);
+		pciep_import_free(buf);
+	}
+}
+
+/**
+ * __pciep_buffer_release() - Detach a buffer from a closing file.
+ * @path:	Path the buffer belongs to.
+ * @buf:	Buffer owned by the file.
+ *
+ * Called with path->lock held.
+ */
+static void __pciep_buffer_release(struct pciep_path *path,
+				   struct pciep_buffer *buf)
+{
+	if (buf == path->active) {
+		buf->orphan = true;
+		buf->stream = NULL;
+		return;
+	}
+	if (buf->state != PCIEP_BUF_USER)
+		list_del(&buf->list);
+	__pciep_buffer_recycle(path, buf);
+}
+
+/**
+ * pciep_path_release() - Return the buffers owned by a file to the pool.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path to clean up.
+ * @file:	File being released.
+ *
+ * A buffer still programmed into the endpoint cannot be reclaimed yet:
+ * it is marked orphan and goes back to the pool when it completes.
+ * Transfers nobody waits for are left to run, detached from the stream
+ * about to be freed.
+ */
+static void pciep_path_release(struct pciep_driver_data *this,
+			       struct pciep_path *path, struct file *file)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_buffer *buf;
+	unsigned long flags;
+	u32 i;
+
+	spin_lock_irqsave(&path->lock, flags);
+	list_for_each_entry(buf, &path->queued, list)
+		if (buf->stream == stream)
+			buf->stream = NULL;
+	if (path->active && path->active->stream == stream)
+		path->active->stream = NULL;
+	for (i = 0; i < this->num_bufs; i++) {
+		if (path->bufs[i].owner == file)
+			__pciep_buffer_release(path, &path->bufs[i]);
+	}
+	for (i = 0; i < MAX_NUM_IMPORTS; i++) {
+		if (path->imports[i] && path->imports[i]->owner == file)
+			__pciep_buffer_release(path, path->imports[i]);
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	pciep_import_reclaim(path);
+}
+
+static void pciep_iocb_read_complete(struct pciep_buffer *buf)
+{
+	__pciep_iocb_done(&buf->stream->this->read_path, buf, buf->bytesused);
+}
+
+static void pciep_iocb_write_complete(struct pciep_buffer *buf)
+{
+	__pciep_iocb_done(&buf->stream->this->write_path, buf, buf->bytesused);
+}
+
+/**
+ * pciep_path_cancel() - Abort the transfers queued for a stream.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path to flush.
+ * @stream:	Stream whose transfers are aborted.
+ *
+ * Blocked read()/write() calls of the stream return -ECANCELED, buffers
+ * queued with QUEUE_BUF stay with the file and can be queued again, and
+ * the buffers of non-blocking read()/write() calls go back to the pool.
+ * Asynchronous read_iter()/write_iter() calls complete with -ECANCELED.
+ * Completed transfers are left alone.
+ */
+static void pciep_path_cancel(struct pciep_driver_data *this,
+			      struct pciep_path *path,
+			      struct pciep_stream *stream)
+{
+	struct pciep_buffer *buf, *tmp, *active;
+	unsigned long flags;
+
+	spin_lock_irqsave(&path->lock, flags);
+	/* the ring first, aborting the active buffer programs the next one */
+	active = path->active;
+	list_for_each_entry_safe(buf, tmp, &path->queued, list) {
+		if (buf->stream != stream)
+			continue;
+		__pciep_path_abort(this, path, buf);
+		__pciep_buffer_drop(path, buf, -ECANCELED);
+	}
+	if (active && active->stream == stream) {
+		__pciep_path_abort(this, path, active);
+		__pciep_buffer_drop(path, active, -ECANCELED);
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	wake_up(&path->wait);
+}
+
+/**
+ * pciep_path_kill() - Abort every transfer of a removed device.
+ * @this:	Pointer to the pciep driver data structure, marked dead.
+ * @path:	Path to flush.
+ *
+ * Like pciep_path_cancel() for all the streams at once, asynchronous
+ * calls complete with -ENODEV. Transfers queued afterwards are dropped
+ * right away, see __pciep_path_queue().
+ */
+static void pciep_path_kill(struct pciep_driver_data *this,
+			    struct pciep_path *path)
+{
+	struct pciep_buffer *buf, *tmp, *active;
+	unsigned long flags;
+
+	spin_lock_irqsave(&path->lock, flags);
+	active = path->active;
+	list_for_each_entry_safe(buf, tmp, &path->queued, list) {
+		__pciep_path_abort(this, path, buf);
+		__pciep_buffer_drop(path, buf, -ENODEV);
+	}
+	if (active) {
+		__pciep_path_abort(this, path, active);
+		__pciep_buffer_drop(path, active, -ENODEV);
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	wake_up(&path->wait);
+}
+
+/*
+ * aio cancel mark of an asynchronous transfer, set in the low bit of the
+ * buffer pointer pciep_iocb_queue() keeps in iocb->private. It belongs to
+ * the kiocb, a buffer queued again for another one does not inherit it.
+ */
+#define PCIEP_IOCB_CANCELLED	1UL
+
+static bool pciep_iocb_cancelled(struct kiocb *iocb)
+{
+	return (unsigned long)READ_ONCE(iocb->private) & PCIEP_IOCB_CANCELLED;
+}
+
+/**
+ * __pciep_iocb_expire() - Time out an asynchronous transfer.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path the transfer belongs to.
+ * @buf:	Queued or active buffer.
+ * @now:	Current time.
+ * @next:	Earliest deadline left so far.
+ * Return:	Earliest deadline left, @buf's included if it is not due.
+ *
+ * Called with path->lock held.
+ */
+static ktime_t __pciep_iocb_expire(struct pciep_driver_data *this,
+				   struct pciep_path *path,
+				   struct pciep_buffer *buf, ktime_t now,
+				   ktime_t next)
+{
+	ktime_t deadline = buf->deadline;
+	bool cancelled;
+
+	if (!buf->iocb)
+		return next;
+	cancelled = pciep_iocb_cancelled(buf->iocb);
+	if (!cancelled && ktime_before(now, deadline))
+		return min(next, deadline);
+
+	__pciep_path_abort(this, path, buf);
+	__pciep_iocb_done(path, buf, cancelled ? -ECANCELED : -ETIMEDOUT);
+	return next;
+}
+
+/**
+ * __pciep_path_iocb_expire() - Time out the asynchronous transfers of a path.
+ * @path:	Path to look at.
+ *
+ * Completes the asynchronous read_iter()/write_iter() calls past their
+ * deadline with -ETIMEDOUT, the cancelled ones with -ECANCELED, and
+ * comes back for the earliest deadline left. Called with path->lock held.
+ */
+static void __pciep_path_iocb_expire(struct pciep_path *path)
+{
+	struct pciep_driver_data *this = pciep_path_to_this(path);
+	struct pciep_buffer *buf, *tmp, *active = path->active;
+	ktime_t now = ktime_get();
+	ktime_t next = KTIME_MAX;
+
+	/* the ring first, aborting the active buffer programs the next one */
+	list_for_each_entry_safe(buf, tmp, &path->queued, list)
+		next = __pciep_iocb_expire(this, path, buf, now, next);
+	if (active)
+		next = __pciep_iocb_expire(this, path, active, now, next);
+
+	if (next != KTIME_MAX)
+		hrtimer_start(&path->iocb_timer, next, HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart pciep_path_iocb_timer(struct hrtimer *timer)
+{
+	struct pciep_path *path = container_of(timer, struct pciep_path,
+					       iocb_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&path->lock, flags);
+	__pciep_path_iocb_expire(path);
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static void pciep_path_iocb_work(struct work_struct *work)
+{
+	struct pciep_path *path = container_of(work, struct pciep_path,
+					       iocb_work);
+	unsigned long flags;
+
+	spin_lock_irqsave(&path->lock, flags);
+	__pciep_path_iocb_expire(path);
+	spin_unlock_irqrestore(&path->lock, flags);
+}
+
+/* set up before the pools, pciep_path_cleanup() cancels them */
+static void pciep_path_iocb_init(struct pciep_path *path)
+{
+	hrtimer_init(&path->iocb_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	path->iocb_timer.function = pciep_path_iocb_timer;
+	INIT_WORK(&path->iocb_work, pciep_path_iocb_work);
+}
+
+/**
+ * pciep_iocb_cancel() - Cancel an asynchronous read_iter()/write_iter().
+ * @iocb:	I/O control block queued by pciep_iocb_queue().
+ * Return:	Success(=0).
+ *
+ * aio calls this with its context lock held, which __pciep_iocb_done()
+ * takes again under path->lock. The kiocb is marked and completed from a
+ * work item, without touching path->lock here. The buffer may have been
+ * completed and queued for another kiocb already, it is not touched.
+ */
+static int pciep_iocb_cancel(struct kiocb *iocb)
+{
+	struct pciep_stream *stream = iocb->ki_filp->private_data;
+	struct pciep_driver_data *this = stream->this;
+	unsigned long priv = (unsigned long)READ_ONCE(iocb->private);
+	struct pciep_buffer *buf = (void *)(priv & ~PCIEP_IOCB_CANCELLED);
+	struct pciep_path *path = &this->read_path;
+
+	WRITE_ONCE(iocb->private, (void *)(priv | PCIEP_IOCB_CANCELLED));
+	if (buf >= this->write_path.bufs &&
+	    buf < this->write_path.bufs + this->num_bufs)
+		path = &this->write_path;
+	schedule_work(&path->iocb_work);
+
+	return 0;
+}
+
+/**
+ * pciep_dio_hold() - Keep a failed direct I/O transfer away from the host.
+ * @path:	Path the transfer belongs to.
+ * @dio:	Transfer whose chunks pciep_path_wait() took back.
+ * Return:	Whether the path holds on to @dio, which is then released by
+ *		__pciep_dio_release().
+ *
+ * Withdrawing the active chunk does not stop a transfer the host already
+ * started, its pages must not be unpinned under it.
+ */
+static bool pciep_dio_hold(struct pciep_path *path, struct pciep_dio *dio)
+{
+	unsigned long flags;
+	bool held = false;
+	unsigned int i;
+
+	spin_lock_irqsave(&path->lock, flags);
+	for (i = 0; i < dio->nents; i++)
+		held |= dio->chunks[i].withdrawn;
+	if (held)
+		list_add_tail(&dio->list, &path->dio_held);
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	return held;
+}
+
+/**
+ * pciep_direct_io() - Transfer straight from/to the user buffer.
+ * @stream:	Stream the transfer is queued for.
+ * @path:	Path the transfer belongs to.
+ * @uaddr:	User buffer address.
+ * @count:	The number of bytes to be transferred.
+ * @offset:	Host offset of the transfer.
+ * @to_user:	The endpoint writes into the user buffer.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * The user pages are pinned and mapped for DMA, and every DMA segment is
+ * handed to the endpoint as its own chunk. This avoids both the bounce
+ * buffer and the copy for transfers too large for a coherent buffer.
+ * A transfer aborted while the host may still access it keeps its pages
+ * pinned, see pciep_dio_hold().
+ */
+static int pciep_direct_io(struct pciep_stream *stream,
+			   struct pciep_path *path, unsigned long uaddr,
+			   size_t count, u64 offset, bool to_user)
+{
+	struct pciep_driver_data *this = stream->this;
+	unsigned int first = offset_in_page(uaddr);
+	struct scatterlist *sg;
+	struct pciep_dio *dio;
+	unsigned int nr_pages;
+	int ret, i;
+
+	dio = kzalloc(sizeof(*dio), GFP_KERNEL);
+	if (!dio)
+		return -ENOMEM;
+	dio->dev = this->dma_dev;
+	dio->dir = to_user ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+
+	nr_pages = DIV_ROUND_UP(first + count, PAGE_SIZE);
+	dio->pages = kvcalloc(nr_pages, sizeof(*dio->pages), GFP_KERNEL);
+	if (!dio->pages) {
+		ret = -ENOMEM;
+		goto free_dio;
+	}
+
+	dio->pinned = pin_user_pages_fast(uaddr & PAGE_MASK, nr_pages,
+					  to_user ? FOLL_WRITE : 0, dio->pages);
+	if (dio->pinned != nr_pages) {
+		ret = dio->pinned < 0 ? dio->pinned : -EFAULT;
+		goto unpin;
+	}
+
+	ret = sg_alloc_table_from_pages(&dio->sgt, dio->pages, nr_pages, first,
+					count, GFP_KERNEL);
+	if (ret)
+		goto unpin;
+
+	ret = dma_map_sgtable(dio->dev, &dio->sgt, dio->dir, 0);
+	if (ret)
+		goto free_table;
+
+	dio->nents = dio->sgt.nents;
+	dio->chunks = kcalloc(dio->nents, sizeof(*dio->chunks), GFP_KERNEL);
+	if (!dio->chunks) {
+		ret = -ENOMEM;
+		goto unmap;
+	}
+
+	for_each_sgtable_dma_sg(&dio->sgt, sg, i) {
+		dio->chunks[i].phys_addr = sg_dma_address(sg);
+		dio->chunks[i].size = sg_dma_len(sg);
+	}
+
+	pciep_path_queue_chunks(this, path, dio->chunks, stream, dio->nents,
+				offset);
+	ret = pciep_path_wait(stream, path, dio->chunks, dio->nents);
+	if (ret && pciep_dio_hold(path, dio))
+		return ret;
+	pciep_dio_free(dio);
+	return ret;
+
+unmap:
+	dma_unmap_sgtable(dio->dev, &dio->sgt, dio->dir, 0);
+free_table:
+	sg_free_table(&dio->sgt);
+unpin:
+	if (dio->pinned > 0)
+		unpin_user_pages_dirty_lock(dio->pages, dio->pinned, false);
+	kvfree(dio->pages);
+free_dio:
+	kfree(dio);
+	return ret;
+}
+
+/**
+ * pciep_desc_to_path() - Look up the path named by a descriptor.
+ * @this:	Pointer to the pciep driver data structure.
+ * @desc:	Descriptor passed from the application.
+ * Return:	Pointer to the path or NULL.
+ */
+static struct pciep_path *pciep_desc_to_path(struct pciep_driver_data *this,
+					     struct buffer_desc *desc)
+{
+	if (desc->type == BUF_TYPE_READ)
+		return &this->read_path;
+	if (desc->type == BUF_TYPE_WRITE)
+		return &this->write_path;
+	return NULL;
+}
+
+/**
+ * pciep_desc_to_buffer() - Look up the buffer named by a descriptor.
+ * @this:	Pointer to the pciep driver data structure.
+ * @desc:	Descriptor passed from the application.
+ * @path:	Returns the path the buffer belongs to.
+ * Return:	Pointer to the buffer or NULL.
+ *
+ * Imports can go away at any time, look them up with path->lock held.
+ */
+static struct pciep_buffer *pciep_desc_to_buffer(struct pciep_driver_data *this,
+						 struct buffer_desc *desc,
+						 struct pciep_path **path)
+{
+	*path = pciep_desc_to_path(this, desc);
+	if (!*path)
+		return NULL;
+
+	if (desc->memory == BUF_MEMORY_DMABUF) {
+		if (desc->index >= MAX_NUM_IMPORTS)
+			return NULL;
+		return (*path)->imports[desc->index];
+	}
+
+	if (desc->memory != BUF_MEMORY_MMAP || desc->index >= this->num_bufs)
+		return NULL;
+
+	return &(*path)->bufs[desc->index];
+}
+
+/**
+ * __pciep_claim_buffer() - Make a buffer owned by a file.
+ * @path:	Path the buffer belongs to.
+ * @buf:	Buffer to claim.
+ * @file:	File claiming the buffer.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * Called with path->lock held. Free pool buffers are taken out of the
+ * pool, buffers already owned by the file are left alone.
+ */
+static int __pciep_claim_buffer(struct pciep_path *path,
+				struct pciep_buffer *buf, struct file *file)
+{
+	if (buf->state == PCIEP_BUF_FREE) {
+		list_del(&buf->list);
+		buf->state = PCIEP_BUF_USER;
+		buf->owner = file;
+		return 0;
+	}
+	if (buf->state != PCIEP_BUF_USER || buf->owner != file)
+		return -EBUSY;
+	return 0;
+}
+
+/**
+ * pciep_buffer_offset() - mmap() offset of a pool buffer.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path the buffer belongs to.
+ * @buf:	Pool buffer.
+ * Return:	Offset to pass to mmap().
+ *
+ * Read buffers are laid out first, followed by the write buffers, each
+ * one taking this->size bytes of the offset space.
+ */
+static u64 pciep_buffer_offset(struct pciep_driver_data *this,
+			       struct pciep_path *path,
+			       struct pciep_buffer *buf)
+{
+	u64 index = buf->index;
+
+	if (path == &this->write_path)
+		index += this->num_bufs;
+
+	return index * this->size;
+}
+
+/**
+ * pciep_file_length() - Length of the file the host offers.
+ * @this:	Pointer to the pciep driver data structure.
+ * Return:	Length in bytes.
+ */
+static u64 pciep_file_length(struct pciep_driver_data *this)
+{
+	u64 high = reg_read(this, PCIRC_READ_FILE_LENGTH - 4);
+
+	return reg_read(this, PCIRC_READ_FILE_LENGTH) | high << 32;
+}
+
+/**
+ * pciep_file_stream_queue() - Queue the next chunk of a streamed file.
+ * @file:	File streaming the host file.
+ * @buf:	Pool buffer to transfer the chunk into.
+ * Return:	Whether the chunk was queued, false once the whole file is.
+ *
+ * Called with stream->file_lock held.
+ */
+static bool pciep_file_stream_queue(struct file *file,
+				    struct pciep_buffer *buf)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	u64 left = stream->file_len - stream->file_queued;
+	size_t count;
+
+	if (!left)
+		return false;
+
+	count = min_t(u64, left, stream->file_chunk);
+	buf->owner = file;
+	/* pipeline frames are handed out through DEQUEUE_BUF */
+	buf->rw = stream->engine == PCIEP_ENGINE_FILE;
+	pciep_path_queue(this, &this->read_path, buf, stream, count,
+			 stream->file_base + stream->file_queued);
+	stream->file_queued += count;
+
+	return true;
+}
+
+/**
+ * __pciep_engine_start() - Start an engine reading the host file.
+ * @file:	File the host file is read through.
+ * @engine:	PCIEP_ENGINE_FILE or PCIEP_ENGINE_PIPELINE.
+ * @len:	No.of bytes of the host file to read.
+ * @chunk:	Chunk size in bytes, at most the pool buffer size.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * The file at the current read offset is split into chunks, and as many
+ * of them as there are free pool buffers are queued right away. Called
+ * with stream->file_lock held.
+ */
+static int __pciep_engine_start(struct file *file, enum pciep_engine engine,
+				u64 len, size_t chunk)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	struct pciep_buffer *buf;
+
+	if (stream->engine != PCIEP_ENGINE_OFF)
+		return -EBUSY;
+
+	stream->engine = engine;
+	stream->file_len = len;
+	stream->file_base = READ_ONCE(stream->read_offset);
+	stream->file_pos = 0;
+	stream->file_queued = 0;
+	stream->file_chunk = chunk;
+	stream->file_cur = NULL;
+
+	while ((buf = pciep_buffer_take(&this->read_path))) {
+		if (!pciep_file_stream_queue(file, buf)) {
+			pciep_buffer_put(this, &this->read_path, buf);
+			break;
+		}
+	}
+	if (len && !stream->file_queued) {
+		stream->engine = PCIEP_ENGINE_OFF;
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+/**
+ * pciep_file_stream_start() - Start streaming the file the host offers.
+ * @file:	File the host file is read through.
+ * @chunk:	Chunk size in bytes, 0 for the pool buffer size.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * The file of GET_FILE_LENGTH bytes is prefetched in chunks. read() then
+ * returns the next bytes of the file, every consumed chunk being queued
+ * again for the next part of the file, so the ring stays full while the
+ * application copies data out.
+ */
+static int pciep_file_stream_start(struct file *file, u32 chunk)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	int ret;
+
+	if (!chunk)
+		chunk = this->size;
+	if (chunk > this->size)
+		return -EINVAL;
+
+	mutex_lock(&stream->file_lock);
+	ret = __pciep_engine_start(file, PCIEP_ENGINE_FILE,
+				   pciep_file_length(this), chunk);
+	mutex_unlock(&stream->file_lock);
+
+	return ret;
+}
+
+/**
+ * pciep_file_stream_stop() - Stop streaming the host file.
+ * @file:	File the host file is read through.
+ *
+ * Chunks in flight are aborted and completed ones dropped.
+ */
+static void pciep_file_stream_stop(struct file *file)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	struct pciep_path *path = &this->read_path;
+	struct pciep_buffer *buf;
+	bool pending;
+
+	mutex_lock(&stream->file_lock);
+	if (stream->engine == PCIEP_ENGINE_FILE) {
+		pciep_path_cancel(this, path, stream);
+		while ((buf = pciep_path_dequeue(path, file, true, &pending)))
+			pciep_buffer_put(this, path, buf);
+		if (stream->file_cur)
+			pciep_buffer_put(this, path, stream->file_cur);
+		stream->file_cur = NULL;
+		stream->engine = PCIEP_ENGINE_OFF;
+	}
+	mutex_unlock(&stream->file_lock);
+}
+
+/**
+ * pciep_file_stream_read() - Read the next bytes of a streamed file.
+ * @file:	File the host file is read through.
+ * @buff:	Pointer to the user buffer.
+ * @count:	The number of bytes to be read.
+ * Return:	No.of bytes read, 0 at the end of the file, or error
+ *		status(<0).
+ */
+static ssize_t pciep_file_stream_read(struct file *file, char __user *buff,
+				      size_t count)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	struct pciep_path *path = &this->read_path;
+	struct pciep_buffer *buf;
+	size_t copied = 0, n;
+	int ret = 0;
+
+	mutex_lock(&stream->file_lock);
+	while (copied < count && stream->file_pos < stream->file_len) {
+		buf = stream->file_cur;
+		if (!buf) {
+			ret = pciep_path_dequeue_wait(path, file, true, &buf);
+			/* nothing in flight, the chunks were cancelled */
+			if (!ret && !buf)
+				ret = -ECANCELED;
+			if (ret)
+				break;
+			stream->file_cur = buf;
+			stream->file_cur_pos = 0;
+			pciep_buffer_sync(buf, 0, buf->bytesused, true);
+		}
+
+		n = min(count - copied, buf->bytesused - stream->file_cur_pos);
+		if (copy_to_user(buff + copied,
+				 buf->virt_addr + stream->file_cur_pos, n)) {
+			ret = -EFAULT;
+			break;
+		}
+		trace_pciep_copy_done(pciep_minor(this), false, n, 0);
+		copied += n;
+		stream->file_cur_pos += n;
+		stream->file_pos += n;
+
+		if (stream->file_cur_pos == buf->bytesused) {
+			stream->file_cur = NULL;
+			if (!pciep_file_stream_queue(file, buf))
+				pciep_buffer_put(this, path, buf);
+		}
+	}
+	mutex_unlock(&stream->file_lock);
+
+	/* bytes already copied win over a later error or -EAGAIN */
+	return copied ? copied : ret;
+}
+
+/**
+ * pciep_frame_stride() - Line length of a raw frame.
+ * @width:	Frame width in pixels.
+ * @format:	RAW_FORMAT_* of the frame.
+ * Return:	Luma line length in bytes, 0 for an unknown format.
+ */
+static u32 pciep_frame_stride(u32 width, u32 format)
+{
+	/* the 10 bit formats pack 3 pixels into 32 bits */
+	switch (format) {
+	case RAW_FORMAT_NV12:
+	case RAW_FORMAT_NV16:
+		return width;
+	case RAW_FORMAT_XV15:
+	case RAW_FORMAT_XV20:
+		return DIV_ROUND_UP(width, 3) * 4;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * pciep_frame_size() - Size of the raw frames the host sends.
+ * @this:	Pointer to the pciep driver data structure.
+ * Return:	Frame size in bytes, 0 for an unknown format.
+ */
+static u32 pciep_frame_size(struct pciep_driver_data *this)
+{
+	u32 value = reg_read(this, PCIRC_RAW_RESOLUTION);
+	u32 width = (value >> WIDTH_SHIFT) & WIDTH_MASK;
+	u32 height = (value >> HEIGHT_SHIFT) & HEIGHT_MASK;
+	u32 format, lines;
+
+	value = reg_read(this, PCIRC_USECASE_MODE);
+	format = (value >> FORMAT_SHIFT) & FORMAT_MASK;
+
+	/* luma plus the 4:2:0 or 4:2:2 chroma plane */
+	if (format == RAW_FORMAT_NV12 || format == RAW_FORMAT_XV15)
+		lines = height * 3 / 2;
+	else
+		lines = height * 2;
+
+	return pciep_frame_stride(width, format) * lines;
+}
+
+/**
+ * pciep_pipeline_start() - Start the host to encoder pipeline.
+ * @file:	File the pipeline runs on.
+ * @config:	Pipeline configuration, completed on return.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * The raw frames of the host file are prefetched into pool buffers and
+ * handed out by DEQUEUE_BUF on the read ring, each DEQUEUE_BUF queueing
+ * the frame handed out before again for a later frame. Encoded frames
+ * queued on the write ring are laid out back to back from the current
+ * write offset and taken back by the next QUEUE_BUF once done, so a
+ * frame costs one DEQUEUE_BUF and one QUEUE_BUF.
+ */
+static int pciep_pipeline_start(struct file *file,
+				struct pipeline_config *config)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	int ret;
+
+	if (config->reserved)
+		return -EINVAL;
+	if (!config->frame_size)
+		config->frame_size = pciep_frame_size(this);
+	if (!config->frame_size || config->frame_size > this->size)
+		return -EINVAL;
+	if (!config->frames)
+		config->frames = div_u64(pciep_file_length(this),
+					 config->frame_size);
+	if (!config->frames)
+		return -ENODATA;
+	config->mode = (reg_read(this, PCIRC_USECASE_MODE) >>
+			USE_CASE_MODE_SHIFT) & USE_CASE_MODE_MASK;
+
+	mutex_lock(&stream->file_lock);
+	ret = __pciep_engine_start(file, PCIEP_ENGINE_PIPELINE,
+				   (u64)config->frames * config->frame_size,
+				   config->frame_size);
+	if (!ret) {
+		stream->pipe_last = NULL;
+		stream->pipe_read_done = false;
+		stream->pipe_write_base = READ_ONCE(stream->write_offset);
+		stream->pipe_write_pos = 0;
+	}
+	mutex_unlock(&stream->file_lock);
+
+	return ret;
+}
+
+/**
+ * pciep_pipeline_dequeue() - Hand out the next raw frame of the pipeline.
+ * @file:	File the pipeline runs on.
+ * @bufp:	Returns the frame.
+ * Return:      Success(=0) or error status(<0), -ENODATA past the last
+ *		frame.
+ *
+ * The host is told the input is done once the last frame is handed out.
+ */
+static int pciep_pipeline_dequeue(struct file *file, struct pciep_buffer **bufp)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	struct pciep_path *path = &this->read_path;
+	struct pciep_buffer *buf;
+	int ret;
+
+	mutex_lock(&stream->file_lock);
+	buf = stream->pipe_last;
+	if (buf && !pciep_file_stream_queue(file, buf))
+		pciep_buffer_put(this, path, buf);
+	stream->pipe_last = NULL;
+
+	ret = pciep_path_dequeue_wait(path, file, false, bufp);
+	if (!ret && !*bufp)
+		ret = -ENODATA;
+	if (!ret) {
+		stream->pipe_last = *bufp;
+		stream->file_pos += (*bufp)->bytesused;
+		if (stream->file_pos == stream->file_len &&
+		    !stream->pipe_read_done) {
+			pciep_transfer_done(this, false, true);
+			stream->pipe_read_done = true;
+		}
+	}
+	mutex_unlock(&stream->file_lock);
+
+	return ret;
+}
+
+/**
+ * pciep_path_pending() - Check for transfers of a stream in flight.
+ * @path:	Path to look at.
+ * @stream:	Stream to look for.
+ * Return:	Whether a buffer of @stream is queued or active.
+ */
+static bool pciep_path_pending(struct pciep_path *path,
+			       struct pciep_stream *stream)
+{
+	struct pciep_buffer *buf;
+	unsigned long flags;
+	bool pending;
+
+	spin_lock_irqsave(&path->lock, flags);
+	pending = path->active && path->active->stream == stream;
+	list_for_each_entry(buf, &path->queued, list) {
+		if (pending)
+			break;
+		if (buf->stream == stream)
+			pending = true;
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	return pending;
+}
+
+/**
+ * pciep_pipeline_stop() - Stop the host to encoder pipeline.
+ * @file:	File the pipeline runs on.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * Raw frames are dropped, encoded frames still queued are waited for, for
+ * the deadline of the stream at most, before the host is told the output
+ * is done.
+ */
+static int pciep_pipeline_stop(struct file *file)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	struct pciep_path *path = &this->read_path;
+	unsigned int msecs = READ_ONCE(stream->timeout_ms);
+	unsigned long flags;
+	long ret = 0;
+	u32 i;
+
+	if (READ_ONCE(stream->engine) != PCIEP_ENGINE_PIPELINE)
+		return -EINVAL;
+	/*
+	 * Kick a DEQUEUE_BUF blocked on the next frame out of the lock, the
+	 * frames it queues meanwhile are owned by the file and dropped below.
+	 */
+	pciep_path_cancel(this, path, stream);
+
+	mutex_lock(&stream->file_lock);
+	if (stream->engine != PCIEP_ENGINE_PIPELINE) {
+		mutex_unlock(&stream->file_lock);
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&path->lock, flags);
+	for (i = 0; i < this->num_bufs; i++) {
+		if (path->bufs[i].owner == file)
+			__pciep_buffer_release(path, &path->bufs[i]);
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+	stream->pipe_last = NULL;
+	stream->engine = PCIEP_ENGINE_OFF;
+	if (!stream->pipe_read_done)
+		pciep_transfer_done(this, false, true);
+
+	ret = wait_event_interruptible_timeout(this->write_path.wait,
+		!pciep_path_pending(&this->write_path, stream),
+		msecs ? msecs_to_jiffies(msecs) : MAX_SCHEDULE_TIMEOUT);
+	if (ret > 0)
+		pciep_transfer_done(this, true, true);
+	mutex_unlock(&stream->file_lock);
+
+	if (ret < 0)
+		return ret;
+	return ret ? 0 : -ETIMEDOUT;
+}
+
+/**
+ * pciep_queue_buf() - Queue a transfer on a pool buffer.
+ * @this:	Pointer to the pciep driver data structure.
+ * @file:	File queueing the buffer.
+ * @desc:	Descriptor passed from the application.
+ * Return:      Success(=0) or error status(<0).
+ */
+static int pciep_queue_buf(struct pciep_driver_data *this, struct file *file,
+			   struct buffer_desc *desc)
+{
+	struct pciep_stream *stream = file->private_data;
+	bool pipeline = READ_ONCE(stream->engine) == PCIEP_ENGINE_PIPELINE;
+	struct pciep_path *path;
+	struct pciep_buffer *buf;
+	unsigned long flags;
+	size_t count;
+	u64 offset;
+	int ret = -EINVAL;
+
+	path = pciep_desc_to_path(this, desc);
+	if (!path)
+		return -EINVAL;
+	/* the pipeline cycles the raw frames itself */
+	if (pipeline && path == &this->read_path)
+		return -EBUSY;
+	offset = READ_ONCE(*pciep_stream_offset(stream, path));
+
+	/* take the buffer out of the pool, it now belongs to this file */
+	spin_lock_irqsave(&path->lock, flags);
+	buf = pciep_desc_to_buffer(this, desc, &path);
+	if (buf) {
+		count = desc->bytesused ? desc->bytesused : buf->size;
+		/* a completed encoded frame needs no DEQUEUE_BUF first */
+		if (pipeline && buf->state == PCIEP_BUF_DONE &&
+		    buf->owner == file) {
+			list_del(&buf->list);
+			buf->state = PCIEP_BUF_USER;
+		}
+		if (count <= buf->size)
+			ret = __pciep_claim_buffer(path, buf, file);
+		if (!ret && pipeline) {
+			offset = stream->pipe_write_base +
+				 stream->pipe_write_pos;
+			stream->pipe_write_pos += count;
+		}
+		if (!ret)
+			__pciep_path_queue(this, path, buf, stream, count,
+					   offset);
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	return ret;
+}
+
+/**
+ * pciep_dequeue_buf() - Wait for the oldest transfer queued by a file.
+ * @this:	Pointer to the pciep driver data structure.
+ * @file:	File that queued the buffers.
+ * @desc:	Descriptor passed from the application, filled on return.
+ * Return:      Success(=0) or error status(<0).
+ */
+static int pciep_dequeue_buf(struct pciep_driver_data *this, struct file *file,
+			     struct buffer_desc *desc)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_path *path;
+	struct pciep_buffer *buf;
+	int ret;
+
+	path = pciep_desc_to_path(this, desc);
+	if (!path)
+		return -EINVAL;
+
+	if (path == &this->read_path &&
+	    READ_ONCE(stream->engine) == PCIEP_ENGINE_PIPELINE)
+		ret = pciep_pipeline_dequeue(file, &buf);
+	else
+		ret = pciep_path_dequeue_wait(path, file, false, &buf);
+	if (ret)
+		return ret;
+	if (!buf)
+		return -EINVAL;
+
+	desc->index = buf->index;
+	desc->length = buf->size;
+	desc->bytesused = buf->bytesused;
+	desc->timestamp = ktime_to_ns(buf->completed);
+	desc->host_timestamp = ktime_to_ns(buf->host_done);
+	if (buf->dmabuf) {
+		desc->memory = BUF_MEMORY_DMABUF;
+		desc->offset = 0;
+	} else {
+		desc->memory = BUF_MEMORY_MMAP;
+		desc->offset = pciep_buffer_offset(this, path, buf);
+	}
+
+	return 0;
+}
+
+/**
+ * struct pciep_export - private data of an exported dma-buf
+ * @this: Pointer to the pciep driver data structure
+ * @path: path the exported buffer belongs to
+ * @buf: exported pool buffer
+ */
+struct pciep_export {
+	struct pciep_driver_data *this;
+	struct pciep_path *path;
+	struct pciep_buffer *buf;
+};
+
+static int pciep_dmabuf_attach(struct dma_buf *dmabuf,
+			       struct dma_buf_attachment *attach)
+{
+	struct pciep_export *exp = dmabuf->priv;
+	struct pciep_buffer *buf = exp->buf;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return -ENOMEM;
+
+	/* cached buffers are plain contiguous pages */
+	if (buf->cached) {
+		ret = sg_alloc_table(sgt, 1, GFP_KERNEL);
+		if (!ret)
+			sg_set_page(sgt->sgl, virt_to_page(buf->virt_addr),
+				    buf->size, 0);
+	} else {
+		ret = dma_get_sgtable(buf->dev, sgt, buf->virt_addr,
+				      buf->phys_addr, buf->size);
+	}
+	if (ret) {
+		kfree(sgt);
+		return ret;
+	}
+	attach->priv = sgt;
+
+	return 0;
+}
+
+static void pciep_dmabuf_detach(struct dma_buf *dmabuf,
+				struct dma_buf_attachment *attach)
+{
+	struct sg_table *sgt = attach->priv;
+
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static struct sg_table *pciep_dmabuf_map(struct dma_buf_attachment *attach,
+					 enum dma_data_direction dir)
+{
+	struct sg_table *sgt = attach->priv;
+	int ret;
+
+	ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (ret)
+		return ERR_PTR(ret);
+
+	return sgt;
+}
+
+static void pciep_dmabuf_unmap(struct dma_buf_attachment *attach,
+			       struct sg_table *sgt,
+			       enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+}
+
+static int pciep_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct pciep_export *exp = dmabuf->priv;
+	struct pciep_buffer *buf = exp->buf;
+	size_t len = vma->vm_end - vma->vm_start;
+
+	if (!buf->cached)
+		return dma_mmap_coherent(buf->dev, vma, buf->virt_addr,
+					 buf->phys_addr, buf->size);
+
+	if (vma->vm_pgoff >= PFN_UP(buf->size) ||
+	    len > buf->size - (vma->vm_pgoff << PAGE_SHIFT))
+		return -EINVAL;
+	return remap_pfn_range(vma, vma->vm_start,
+			       page_to_pfn(virt_to_page(buf->virt_addr)) +
+			       vma->vm_pgoff, len, vma->vm_page_prot);
+}
+
+static int pciep_dmabuf_begin_cpu_access(struct dma_buf *dmabuf,
+					 enum dma_data_direction dir)
+{
+	struct pciep_export *exp = dmabuf->priv;
+
+	pciep_buffer_sync(exp->buf, 0, exp->buf->size, true);
+	return 0;
+}
+
+static int pciep_dmabuf_end_cpu_access(struct dma_buf *dmabuf,
+				       enum dma_data_direction dir)
+{
+	struct pciep_export *exp = dmabuf->priv;
+
+	pciep_buffer_sync(exp->buf, 0, exp->buf->size, false);
+	return 0;
+}
+
+static void pciep_dmabuf_release(struct dma_buf *dmabuf)
+{
+	struct pciep_export *exp = dmabuf->priv;
+	struct pciep_path *path = exp->path;
+	struct pciep_buffer *buf = exp->buf;
+	unsigned long flags;
+
+	/* a detached buffer goes back to the pool with its last export */
+	spin_lock_irqsave(&path->lock, flags);
+	if (!--buf->exported && !buf->owner && buf->state == PCIEP_BUF_USER)
+		__pciep_buffer_recycle(path, buf);
+	spin_unlock_irqrestore(&path->lock, flags);
+	wake_up(&path->wait);
+
+	pciep_put(exp->this);
+	kfree(exp);
+}
+
+static const struct dma_buf_ops pciep_dmabuf_ops = {
+	.attach        = pciep_dmabuf_attach,
+	.detach        = pciep_dmabuf_detach,
+	.map_dma_buf   = pciep_dmabuf_map,
+	.unmap_dma_buf = pciep_dmabuf_unmap,
+	.mmap          = pciep_dmabuf_mmap,
+	.begin_cpu_access = pciep_dmabuf_begin_cpu_access,
+	.end_cpu_access   = pciep_dmabuf_end_cpu_access,
+	.release       = pciep_dmabuf_release,
+};
+
+/**
+ * pciep_export_buf() - Export a pool buffer as a dma-buf.
+ * @this:	Pointer to the pciep driver data structure.
+ * @file:	File exporting the buffer.
+ * @desc:	Descriptor passed from the application, fd filled on return.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * The buffer becomes owned by the file, which keeps queueing it by index
+ * while other devices access it through the dma-buf.
+ */
+static int pciep_export_buf(struct pciep_driver_data *this, struct file *file,
+			    struct buffer_desc *desc)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct pciep_export *exp;
+	struct dma_buf *dmabuf;
+	struct pciep_path *path;
+	struct pciep_buffer *buf;
+	unsigned long flags;
+	int ret;
+
+	if (desc->memory != BUF_MEMORY_MMAP)
+		return -EINVAL;
+	buf = pciep_desc_to_buffer(this, desc, &path);
+	if (!buf)
+		return -EINVAL;
+
+	exp = kzalloc(sizeof(*exp), GFP_KERNEL);
+	if (!exp)
+		return -ENOMEM;
+	exp->this = this;
+	exp->path = path;
+	exp->buf = buf;
+
+	spin_lock_irqsave(&path->lock, flags);
+	ret = __pciep_claim_buffer(path, buf, file);
+	if (!ret)
+		buf->exported++;
+	spin_unlock_irqrestore(&path->lock, flags);
+	if (ret) {
+		kfree(exp);
+		return ret;
+	}
+
+	exp_info.ops = &pciep_dmabuf_ops;
+	exp_info.size = buf->size;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = exp;
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		spin_lock_irqsave(&path->lock, flags);
+		buf->exported--;
+		spin_unlock_irqrestore(&path->lock, flags);
+		kfree(exp);
+		return PTR_ERR(dmabuf);
+	}
+	/* the buffer outlives the device, see pciep_dmabuf_release() */
+	pciep_get(this);
+
+	/* from here on the release callback undoes the export */
+	ret = dma_buf_fd(dmabuf, O_CLOEXEC);
+	if (ret < 0) {
+		dma_buf_put(dmabuf);
+		return ret;
+	}
+	desc->fd = ret;
+
+	return 0;
+}
+
+/**
+ * pciep_import_buf() - Import a dma-buf as a transfer target.
+ * @this:	Pointer to the pciep driver data structure.
+ * @file:	File importing the buffer.
+ * @desc:	Descriptor passed from the application, index and length
+ *		filled on return.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * The dma-buf is attached and mapped once, queueing it afterwards costs
+ * no more than queueing a pool buffer. The endpoint takes one address
+ * per transfer, so the mapping must be a single contiguous DMA segment.
+ */
+static int pciep_import_buf(struct pciep_driver_data *this, struct file *file,
+			    struct buffer_desc *desc)
+{
+	struct pciep_path *path;
+	struct pciep_buffer *buf;
+	unsigned long flags;
+	int ret;
+	u32 i;
+
+	path = pciep_desc_to_path(this, desc);
+	if (!path)
+		return -EINVAL;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	buf->dma_dir = path == &this->read_path ? DMA_FROM_DEVICE :
+						  DMA_TO_DEVICE;
+	buf->dmabuf = dma_buf_get(desc->fd);
+	if (IS_ERR(buf->dmabuf)) {
+		ret = PTR_ERR(buf->dmabuf);
+		goto free;
+	}
+
+	buf->attach = dma_buf_attach(buf->dmabuf, this->dma_dev);
+	if (IS_ERR(buf->attach)) {
+		ret = PTR_ERR(buf->attach);
+		goto put;
+	}
+
+	buf->sgt = pciep_dma_buf_map(buf->attach, buf->dma_dir);
+	if (IS_ERR(buf->sgt)) {
+		ret = PTR_ERR(buf->sgt);
+		goto detach;
+	}
+
+	if (buf->sgt->nents != 1) {
+		dev_err(this->dma_dev, "%s imported dma-buf not contiguous\n",
+			path->name);
+		ret = -EINVAL;
+		goto unmap;
+	}
+	buf->phys_addr = sg_dma_address(buf->sgt->sgl);
+	buf->size = sg_dma_len(buf->sgt->sgl);
+	buf->state = PCIEP_BUF_USER;
+	buf->owner = file;
+
+	/* make room from imports left behind by closed files */
+	pciep_import_reclaim(path);
+
+	ret = -ENOSPC;
+	spin_lock_irqsave(&path->lock, flags);
+	for (i = 0; i < MAX_NUM_IMPORTS; i++) {
+		if (!path->imports[i]) {
+			buf->index = i;
+			path->imports[i] = buf;
+			ret = 0;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+	if (ret)
+		goto unmap;
+
+	desc->index = buf->index;
+	desc->length = buf->size;
+	desc->memory = BUF_MEMORY_DMABUF;
+
+	return 0;
+unmap:
+	pciep_dma_buf_unmap(buf->attach, buf->sgt, buf->dma_dir);
+detach:
+	dma_buf_detach(buf->dmabuf, buf->attach);
+put:
+	dma_buf_put(buf->dmabuf);
+free:
+	kfree(buf);
+	return ret;
+}
+
+/**
+ * pciep_unimport_buf() - Release an imported dma-buf.
+ * @this:	Pointer to the pciep driver data structure.
+ * @file:	File that imported the buffer.
+ * @desc:	Descriptor passed from the application.
+ * Return:      Success(=0) or error status(<0).
+ */
+static int pciep_unimport_buf(struct pciep_driver_data *this,
+			      struct file *file, struct buffer_desc *desc)
+{
+	struct pciep_path *path;
+	struct pciep_buffer *buf;
+	unsigned long flags;
+	int ret = 0;
+
+	path = pciep_desc_to_path(this, desc);
+	if (!path || desc->index >= MAX_NUM_IMPORTS)
+		return -EINVAL;
+
+	spin_lock_irqsave(&path->lock, flags);
+	buf = path->imports[desc->index];
+	if (!buf || buf->owner != file)
+		ret = -EINVAL;
+	else if (buf->state != PCIEP_BUF_USER)
+		ret = -EBUSY;
+	else
+		path->imports[desc->index] = NULL;
+	spin_unlock_irqrestore(&path->lock, flags);
+
+	if (!ret)
+		pciep_import_free(buf);
+
+	return ret;
+}
+
+/**
+ * __pciep_path_swap_pool() - Replace the buffer pool of an idle path.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path to update.
+ * @bufs:	New pool returned by pciep_pool_alloc().
+ * Return:	The previous pool or NULL if the path is busy.
+ *
+ * Called with path->lock held. The path is idle when nothing is being
+ * transferred and every pool buffer is free and not exported.
+ */
+static struct pciep_buffer *__pciep_path_swap_pool(struct pciep_driver_data *this,
+						   struct pciep_path *path,
+						   struct pciep_buffer *bufs)
+{
+	struct pciep_buffer *old = path->bufs;
+	u32 i;
+
+	if (path->active || !list_empty(&path->queued))
+		return NULL;
+	for (i = 0; i < this->num_bufs; i++) {
+		if (old[i].state != PCIEP_BUF_FREE || old[i].exported)
+			return NULL;
+	}
+
+	INIT_LIST_HEAD(&path->free);
+	for (i = 0; i < this->num_bufs; i++)
+		list_add_tail(&bufs[i].list, &path->free);
+	path->bufs = bufs;
+
+	return old;
+}
+
+/**
+ * pciep_realloc_pools() - Replace the buffer pools.
+ * @this:	Pointer to the pciep driver data structure.
+ * @placement:	BUF_PLACEMENT_PS or BUF_PLACEMENT_PL.
+ * @cache:	BUF_CACHE_UNCACHED or BUF_CACHE_STREAMING.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * The new pools are allocated before the old ones are released, the
+ * switch fails with -EBUSY while a pool buffer is mapped, exported or
+ * taking part in a transfer.
+ */
+static int pciep_realloc_pools(struct pciep_driver_data *this, u32 placement,
+			       u32 cache)
+{
+	struct pciep_buffer *rd_bufs = NULL, *wr_bufs = NULL;
+	struct pciep_buffer *rd_old, *wr_old = NULL;
+	struct device *dev;
+	unsigned long flags;
+	int ret = 0;
+
+	mutex_lock(&this->lock);
+	if (placement == this->placement && cache == this->cache)
+		goto out;
+	if (atomic_read(&this->mmaps)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	dev = placement == BUF_PLACEMENT_PL ? this->pl_dev : this->dma_dev;
+	rd_bufs = pciep_pool_alloc(this, &this->read_path, dev, cache);
+	wr_bufs = pciep_pool_alloc(this, &this->write_path, dev, cache);
+	if (!rd_bufs || !wr_bufs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	spin_lock_irqsave(&this->read_path.lock, flags);
+	spin_lock(&this->write_path.lock);
+	rd_old = __pciep_path_swap_pool(this, &this->read_path, rd_bufs);
+	if (rd_old) {
+		wr_old = __pciep_path_swap_pool(this, &this->write_path,
+						wr_bufs);
+		if (!wr_old)
+			__pciep_path_swap_pool(this, &this->read_path, rd_old);
+	}
+	spin_unlock(&this->write_path.lock);
+	spin_unlock_irqrestore(&this->read_path.lock, flags);
+
+	if (!wr_old) {
+		ret = -EBUSY;
+		goto out;
+	}
+	WRITE_ONCE(this->placement, placement);
+	WRITE_ONCE(this->cache, cache);
+	rd_bufs = rd_old;
+	wr_bufs = wr_old;
+out:
+	mutex_unlock(&this->lock);
+	if (rd_bufs)
+		pciep_pool_free(this, rd_bufs);
+	if (wr_bufs)
+		pciep_pool_free(this, wr_bufs);
+	return ret;
+}
+
+/**
+ * pciep_set_placement() - Move the buffer pools to PS or PL DDR.
+ * @this:	Pointer to the pciep driver data structure.
+ * @placement:	BUF_PLACEMENT_PS or BUF_PLACEMENT_PL.
+ * Return:      Success(=0) or error status(<0).
+ */
+static int pciep_set_placement(struct pciep_driver_data *this, u32 placement)
+{
+	if (placement != BUF_PLACEMENT_PS && placement != BUF_PLACEMENT_PL)
+		return -EINVAL;
+	if (placement == BUF_PLACEMENT_PL && !this->pl_dev)
+		return -ENODEV;
+
+	return pciep_realloc_pools(this, placement, READ_ONCE(this->cache));
+}
+
+/**
+ * pciep_set_cache() - Switch the buffer pools to cached or uncached.
+ * @this:	Pointer to the pciep driver data structure.
+ * @cache:	BUF_CACHE_UNCACHED or BUF_CACHE_STREAMING.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * Streaming buffers are cached: read() and write() copy them at memory
+ * speed, but QUEUE_BUF users hand them over with SYNC_BUF. Only PS DDR
+ * pools can be streaming, PL DDR ones stay coherent whatever the policy.
+ */
+static int pciep_set_cache(struct pciep_driver_data *this, u32 cache)
+{
+	if (cache != BUF_CACHE_UNCACHED && cache != BUF_CACHE_STREAMING)
+		return -EINVAL;
+
+	return pciep_realloc_pools(this, READ_ONCE(this->placement), cache);
+}
+
+/**
+ * pciep_get_cache() - Report how the CPU sees the pool buffers.
+ * @this:	Pointer to the pciep driver data structure.
+ * Return:	BUF_CACHE_COHERENT, BUF_CACHE_STREAMING or BUF_CACHE_UNCACHED.
+ */
+static u32 pciep_get_cache(struct pciep_driver_data *this)
+{
+	if (this->coherent)
+		return BUF_CACHE_COHERENT;
+	if (READ_ONCE(this->placement) == BUF_PLACEMENT_PL)
+		return BUF_CACHE_UNCACHED;
+	return READ_ONCE(this->cache);
+}
+
+/**
+ * pciep_stream_set_qos() - Set the QoS class, weight and cap of a stream.
+ * @stream:	Stream context of the file.
+ * @qos:	Settings passed from the application.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * Transfers already queued keep their class. Only a privileged caller
+ * may move a stream ahead of everybody else.
+ */
+static int pciep_stream_set_qos(struct pciep_stream *stream,
+				struct stream_qos *qos)
+{
+	if (qos->reserved || qos->prio_class > QOS_CLASS_BULK ||
+	    qos->weight > QOS_WEIGHT_MAX)
+		return -EINVAL;
+	if (qos->prio_class == QOS_CLASS_REALTIME && !capable(CAP_SYS_NICE))
+		return -EPERM;
+
+	WRITE_ONCE(stream->qos_class, qos->prio_class);
+	WRITE_ONCE(stream->qos_weight,
+		   qos->weight ? qos->weight : QOS_WEIGHT_DEFAULT);
+	WRITE_ONCE(stream->qos_rate, qos->max_rate);
+
+	return 0;
+}
+
+/**
+ * pciep_sync_buf() - Hand a range of a pool buffer to the CPU or endpoint.
+ * @this:	Pointer to the pciep driver data structure.
+ * @sync:	Descriptor passed from the application.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * SYNC_BUF_START makes what the endpoint wrote in the range visible to
+ * the CPU, SYNC_BUF_END makes what the CPU wrote visible to the endpoint.
+ * Only the range the application touches is synced, which is the whole
+ * point of handing buffers over explicitly.
+ */
+static int pciep_sync_buf(struct pciep_driver_data *this,
+			  struct buffer_sync *sync)
+{
+	struct pciep_path *path;
+	u64 len;
+
+	if (sync->reserved ||
+	    (sync->flags != SYNC_BUF_START && sync->flags != SYNC_BUF_END))
+		return -EINVAL;
+	if (sync->type == BUF_TYPE_READ)
+		path = &this->read_path;
+	else if (sync->type == BUF_TYPE_WRITE)
+		path = &this->write_path;
+	else
+		return -EINVAL;
+	if (sync->index >= this->num_bufs || sync->offset > this->size)
+		return -EINVAL;
+	len = sync->length ? sync->length : this->size - sync->offset;
+	if (len > this->size - sync->offset)
+		return -EINVAL;
+
+	/* this->lock keeps pciep_set_placement() from moving the pool */
+	mutex_lock(&this->lock);
+	pciep_buffer_sync(&path->bufs[sync->index], sync->offset, len,
+			  sync->flags == SYNC_BUF_START);
+	mutex_unlock(&this->lock);
+
+	return 0;
+}
+
+/**
+ * pciep_path_reset() - Drop the transfers left over by closed files.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path to reset.
+ *
+ * Only called when no file is open: whatever is still queued or in
+ * flight was orphaned by a closed file and the endpoint is about to be
+ * reset under it, so the buffers go straight back to the pool.
+ */
+static void pciep_path_reset(struct pciep_driver_data *this,
+			     struct pciep_path *path)
+{
+	struct pciep_buffer *buf;
+	unsigned long flags;
+
+	spin_lock_irqsave(&path->lock, flags);
+	if (path->active)
+		list_add_tail(&path->active->list, &path->queued);
+	path->active = NULL;
+	while ((buf = list_first_entry_or_null(&path->queued,
+					       struct pciep_buffer, list))) {
+		list_del(&buf->list);
+		__pciep_buffer_recycle(path, buf);
+	}
+	reg_write(this, path->regs->ready, PCIEP_CLR_REG);
+	pciep_path_load_shadow(this, path);
+	__pciep_dio_release(path);
+	__pciep_path_pm(this, path);
+	spin_unlock_irqrestore(&path->lock, flags);
+}
+
+static int pcie_reset_all(struct pciep_driver_data *this)
+{
+	if (this) {
+		pciep_transfer_done(this, false, false);
+		pciep_transfer_done(this, true, false);
+		reg_write(this, PCIEP_READ_BUFFER_OFFSET, PCIEP_CLR_REG);
+		reg_write(this, PCIEP_READ_BUFFER_SIZE, PCIEP_CLR_REG);
+		reg_write(this, PCIEP_WRITE_BUFFER_SIZE, PCIEP_CLR_REG);
+		pciep_path_reset(this, &this->read_path);
+		pciep_path_reset(this, &this->write_path);
+	}
+	else {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * pciep_read_enc_params() - Read the encoder parameters set by the host.
+ * @this:	Pointer to the pciep driver data structure.
+ * @params:	Filled with the decoded parameters.
+ */
+static void pciep_read_enc_params(struct pciep_driver_data *this,
+				  struct enc_params *params)
+{
+	u32 value;
+
+	memset(params, 0, sizeof(*params));
+
+	value = reg_read(this, PCIRC_ENC_PARAMS_1);
+	params->enable_l2Cache = (value>>L2CACHE_SHIFT) & L2CACHE_MASK;
+	params->low_bandwidth = (value>>LOW_BANDWIDTH_SHIFT) & LOW_BANDWIDTH_MASK;
+	params->filler_data = (value>>FILLER_DATA_SHIFT) & FILLER_DATA_MASK;
+	params->bitrate = (value>>BITRATE_SHIFT) & BITRATE_MASK;
+	params->gop_len = (value>>GOP_LENGTH_SHIFT) & GOP_LENGTH_MASK;
+	params->max_picture_size = (value>>MAX_PICTURE_SIZE_SHIFT) & MAX_PICTURE_SIZE_MASK;
+
+	value = reg_read(this, PCIRC_ENC_PARAMS_2);
+	params->b_frame = (value>>B_FRAME_SHIFT) & B_FRAME_MASK;
+	params->slice = (value>>SLICE_SHIFT) & SLICE_MASK;
+	params->qp_mode = (value>>QP_MODE_SHIFT) & QP_MODE_MASK;
+	params->rc_mode = (value>>RC_MODE_SHIFT) & RC_MODE_MASK;
+	params->enc_type = (value>>ENC_TYPE_SHIFT) & ENC_TYPE_MASK;
+	params->gop_mode = (value>>GOP_MODE_SHIFT) & GOP_MODE_MASK;
+	params->profile = (value>>PROFILE_SHIFT) & PROFILE_MASK;
+	params->min_qp = (value>>MIN_QP_SHIFT) & MIN_QP_MASK;
+	params->max_qp = (value>>MAX_QP_SHIFT) & MAX_QP_MASK;
+
+	value = reg_read(this, PCIRC_ENC_PARAMS_3);
+	params->cpb_size = (value>>CPB_SIZE_SHIFT) & CPB_SIZE_MASK;
+	value = reg_read(this, PCIRC_ENC_PARAMS_4);
+	params->initial_delay = (value>>INITIAL_DELAY_SHIFT) & INITIAL_DELAY_MASK;
+	value = reg_read(this, PCIRC_ENC_PARAMS_5);
+	params->periodicity_idr = (value>>PERIODICITY_IDR_SHIFT) & PERIODICITY_IDR_MASK;
+}
+
+/**
+ * pciep_read_config() - Read the whole host configuration.
+ * @this:	Pointer to the pciep driver data structure.
+ * @config:	Filled with the configuration, generation left at zero.
+ *
+ * Every register is read once, PCIRC_USECASE_MODE carries the mode, the
+ * frame rate and the format.
+ */
+static void pciep_read_config(struct pciep_driver_data *this,
+			      struct stream_config *config)
+{
+	u32 value;
+
+	memset(config, 0, sizeof(*config));
+	config->version = STREAM_CONFIG_VERSION;
+	pciep_read_enc_params(this, &config->params);
+
+	value = reg_read(this, PCIRC_RAW_RESOLUTION);
+	config->res.width = (value>>WIDTH_SHIFT) & WIDTH_MASK;
+	config->res.height = (value>>HEIGHT_SHIFT) & HEIGHT_MASK;
+
+	value = reg_read(this, PCIRC_USECASE_MODE);
+	config->mode = (value >> USE_CASE_MODE_SHIFT) & USE_CASE_MODE_MASK;
+	config->fps = (value >> FPS_SHIFT) & FPS_MASK;
+	config->format = (value >> FORMAT_SHIFT) & FORMAT_MASK;
+}
+
+/**
+ * pciep_refresh_config() - Re-read the host configuration into the cache.
+ * @this:	Pointer to the pciep driver data structure.
+ *
+ * Called when the host signals it is done with a configuration. The
+ * generation only moves, and pollers only wake up, on an actual change.
+ */
+static void pciep_refresh_config(struct pciep_driver_data *this)
+{
+	struct stream_config config;
+	bool changed;
+
+	pciep_read_config(this, &config);
+
+	mutex_lock(&this->config_lock);
+	config.generation = this->config.generation;
+	changed = !this->config_valid ||
+		  memcmp(&config, &this->config, sizeof(config));
+	if (changed) {
+		config.generation++;
+		this->config = config;
+		this->config_valid = true;
+	}
+	mutex_unlock(&this->config_lock);
+
+	if (changed)
+		wake_up(&this->config_wait);
+}
+
+/**
+ * pciep_get_config() - Snapshot of the host configuration.
+ * @this:	Pointer to the pciep driver data structure.
+ * @config:	Filled with the cached configuration.
+ *
+ * The registers are only read when the cache has never been filled, the
+ * host done interrupt keeps it up to date afterwards.
+ */
+static void pciep_get_config(struct pciep_driver_data *this,
+			     struct stream_config *config)
+{
+	mutex_lock(&this->config_lock);
+	if (!this->config_valid) {
+		pciep_read_config(this, &this->config);
+		this->config.generation = 1;
+		this->config_valid = true;
+	}
+	*config = this->config;
+	mutex_unlock(&this->config_lock);
+}
+
+/**
+ * pciep_set_irq_affinity() - Steer the interrupts of the device.
+ * @this:	Pointer to the pciep driver data structure.
+ * @cpu:	CPU running the pipeline thread, or IRQ_AFFINITY_NONE.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * The interrupts are moved to @cpu and the hint is kept for irqbalance,
+ * so the ring state stays warm in the cache of the consuming thread.
+ */
+static int pciep_set_irq_affinity(struct pciep_driver_data *this, u32 cpu)
+{
+	const struct cpumask *mask = NULL;
+
+	if (!capable(CAP_SYS_NICE))
+		return -EPERM;
+	if (cpu != IRQ_AFFINITY_NONE) {
+		if (cpu >= nr_cpu_ids || !cpu_online(cpu))
+			return -EINVAL;
+		mask = cpumask_of(cpu);
+	}
+
+	irq_set_affinity_hint(this->rd_irq, mask);
+	irq_set_affinity_hint(this->wr_irq, mask);
+	irq_set_affinity_hint(this->host_done_irq, mask);
+
+	return 0;
+}
+
+/**
+ * pciep_stream_cancel() - Abort the transfers in flight of a stream.
+ * @stream:	Stream context of the file.
+ * @type:	BUF_TYPE_READ, BUF_TYPE_WRITE or BUF_TYPE_ALL.
+ * Return:      Success(=0) or error status(<0).
+ */
+static int pciep_stream_cancel(struct pciep_stream *stream, u32 type)
+{
+	struct pciep_driver_data *this = stream->this;
+
+	if (type != BUF_TYPE_READ && type != BUF_TYPE_WRITE &&
+	    type != BUF_TYPE_ALL)
+		return -EINVAL;
+
+	if (type != BUF_TYPE_WRITE)
+		pciep_path_cancel(this, &this->read_path, stream);
+	if (type != BUF_TYPE_READ)
+		pciep_path_cancel(this, &this->write_path, stream);
+
+	return 0;
+}
+
+/**
+ * pciep_users_get() - Account a new open file of the endpoint.
+ * @this:	Pointer to the pciep driver data structure, resumed.
+ *
+ * Only the first open resets the endpoint, others share it. An open file
+ * does not keep the endpoint resumed: a host done fired while suspended
+ * resumes it, see xilinx_pciep_host_done_irq_handler(), and a pending
+ * SET_*_TRANSFER_DONE handshake holds a reference of its own.
+ */
+static void pciep_users_get(struct pciep_driver_data *this)
+{
+	mutex_lock(&this->lock);
+	if (this->open_count++ == 0)
+		pcie_reset_all(this);
+	mutex_unlock(&this->lock);
+}
+
+/**
+ * pciep_users_put() - Account a closed file of the endpoint.
+ * @this:	Pointer to the pciep driver data structure, resumed or dead.
+ *
+ * The registers are cleared once the last user is gone, unless the
+ * device was removed under it.
+ */
+static void pciep_users_put(struct pciep_driver_data *this)
+{
+	mutex_lock(&this->lock);
+	if (--this->open_count == 0 && !READ_ONCE(this->dead)) {
+		pciep_path_set_offset(this, &this->read_path, 0);
+		reg_write(this, PCIEP_READ_BUFFER_SIZE, PCIEP_CLR_REG);
+		reg_write(this, PCIEP_WRITE_BUFFER_SIZE, PCIEP_CLR_REG);
+	}
+	mutex_unlock(&this->lock);
+}
+
+/**
+ * pciep_driver_file_open() - This is the driver open function.
+ * @inode:	Pointer to the inode structure of this device.
+ * @file:	Pointer to the file structure.
+ * Return:      Success(=0) or error status(<0).
+ */
+static int pciep_driver_file_open(struct inode *inode, struct file *file)
+{
+	struct pciep_driver_data *this;
+	struct pciep_stream *stream;
+	int status = 0;
+
+	mutex_lock(&pciep_devices_lock);
+	this = pciep_devices[iminor(inode)];
+	if (this)
+		pciep_get(this);
+	mutex_unlock(&pciep_devices_lock);
+	if (!this)
+		return -ENODEV;
+
+	/* every file is a stream of its own, with its own offsets */
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream) {
+		pciep_put(this);
+		return -ENOMEM;
+	}
+	stream->this = this;
+	stream->timeout_ms = READ_ONCE(transfer_timeout_ms);
+	stream->qos_class = QOS_CLASS_NORMAL;
+	stream->qos_weight = QOS_WEIGHT_DEFAULT;
+	mutex_init(&stream->file_lock);
+	file->private_data = stream;
+	/* read_iter()/write_iter() honour IOCB_NOWAIT, see there */
+	file->f_mode |= FMODE_NOWAIT;
+
+	status = pciep_pm_get(this);
+	if (status) {
+		kfree(stream);
+		pciep_put(this);
+		return status;
+	}
+
+	pciep_users_get(this);
+
+	pciep_pm_put(this);
+	return status;
+}
+
+/**
+ * pciep_driver_file_release() - This is the driver release function.
+ * @inode:	Pointer to the inode structure of this device.
+ * @file:	Pointer to the file structure.
+ * Return:      Success(=0) or error status(<0).
+ */
+static int pciep_driver_file_release(struct inode *inode, struct file *file)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	bool live = !pciep_op_begin(this);
+
+	/*
+	 * A close cannot fail, it goes ahead even if the resume did, and
+	 * past the removal without touching the registers.
+	 */
+	if (live)
+		pm_runtime_get_sync(this->dma_dev);
+
+	/* buffers still held by the application go back to the pool */
+	pciep_path_release(this, &this->read_path, file);
+	pciep_path_release(this, &this->write_path, file);
+
+	pciep_users_put(this);
+
+	if (live)
+		pciep_pm_put(this);
+	if (stream->read_spare)
+		pciep_buffer_free(stream->read_spare);
+	if (stream->write_spare)
+		pciep_buffer_free(stream->write_spare);
+	kfree(stream);
+	pciep_put(this);
+	return 0;
+}
+
+/**
+ * pciep_mmap_to_buffer() - Pool buffer behind an mmap() offset.
+ * @this:	Pointer to the pciep driver data structure.
+ * @offset:	Offset in the device file, see pciep_buffer_offset().
+ * @pos:	Returns the offset in the buffer.
+ * Return:	The buffer or NULL past the last one.
+ */
+static struct pciep_buffer *pciep_mmap_to_buffer(struct pciep_driver_data *this,
+						 u64 offset, u64 *pos)
+{
+	struct pciep_path *path = &this->read_path;
+	u64 index;
+
+	index = div64_u64_rem(offset, this->size, pos);
+	if (index >= 2 * this->num_bufs)
+		return NULL;
+	if (index >= this->num_bufs) {
+		path = &this->write_path;
+		index -= this->num_bufs;
+	}
+
+	return &path->bufs[index];
+}
+
+/*
+ * Every mapping keeps its buffer off the free list while FREE and counts
+ * against the pools moving. The file a mapping holds keeps the pools
+ * themselves until the last one is gone, past a removal too.
+ */
+static void pciep_vm_open(struct vm_area_struct *vma)
+{
+	struct pciep_driver_data *this = vma->vm_private_data;
+	struct pciep_path *path = &this->write_path;
+	struct pciep_buffer *buf;
+	unsigned long flags;
+	u64 pos;
+
+	buf = pciep_mmap_to_buffer(this, (u64)vma->vm_pgoff << PAGE_SHIFT,
+				   &pos);
+	if (buf < path->bufs || buf >= path->bufs + this->num_bufs)
+		path = &this->read_path;
+
+	spin_lock_irqsave(&path->lock, flags);
+	if (!buf->mapped++ && buf->state == PCIEP_BUF_FREE)
+		list_del_init(&buf->list);
+	spin_unlock_irqrestore(&path->lock, flags);
+	atomic_inc(&this->mmaps);
+}
+
+static void pciep_vm_close(struct vm_area_struct *vma)
+{
+	struct pciep_driver_data *this = vma->vm_private_data;
+	struct pciep_path *path = &this->write_path;
+	struct pciep_buffer *buf;
+	unsigned long flags;
+	bool wake = false;
+	u64 pos;
+
+	buf = pciep_mmap_to_buffer(this, (u64)vma->vm_pgoff << PAGE_SHIFT,
+				   &pos);
+	if (buf < path->bufs || buf >= path->bufs + this->num_bufs)
+		path = &this->read_path;
+
+	spin_lock_irqsave(&path->lock, flags);
+	if (!--buf->mapped && buf->state == PCIEP_BUF_FREE) {
+		list_add_tail(&buf->list, &path->free);
+		wake = true;
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+	atomic_dec(&this->mmaps);
+
+	/* a free buffer makes the write path writable again */
+	if (wake)
+		wake_up(&path->wait);
+}
+
+static const struct vm_operations_struct pciep_vm_ops = {
+	.open  = pciep_vm_open,
+	.close = pciep_vm_close,
+};
+
+static vm_fault_t pciep_vm_fault(struct vm_fault *vmf)
+{
+	struct pciep_driver_data *this = vmf->vma->vm_private_data;
+	struct pciep_buffer *buf;
+	u64 pos;
+
+	buf = pciep_mmap_to_buffer(this, (u64)vmf->pgoff << PAGE_SHIFT, &pos);
+	if (!buf)
+		return VM_FAULT_SIGBUS;
+
+	return vmf_insert_pfn(vmf->vma, vmf->address,
+			      page_to_pfn(virt_to_page(buf->virt_addr)) +
+			      (pos >> PAGE_SHIFT));
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Maps a 2MB page when the whole of it sits in both the mapping and the
+ * buffer, and buffer and user address are aligned alike. CMA aligns
+ * buffers to CONFIG_CMA_ALIGNMENT only, misaligned ones fall back to 4K.
+ */
+static vm_fault_t pciep_vm_huge_fault(struct vm_fault *vmf,
+				      pciep_fault_size size)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct pciep_driver_data *this = vma->vm_private_data;
+	unsigned long addr = vmf->address & PMD_MASK;
+	struct pciep_buffer *buf;
+	unsigned long pfn;
+	u64 pos;
+
+	if (size != PCIEP_FAULT_PMD || !(vma->vm_flags & VM_SHARED) ||
+	    addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+
+	buf = pciep_mmap_to_buffer(this, (u64)(vmf->pgoff -
+				   ((vmf->address - addr) >> PAGE_SHIFT)) <<
+				   PAGE_SHIFT, &pos);
+	if (!buf || pos + PMD_SIZE > buf->size)
+		return VM_FAULT_FALLBACK;
+	pfn = page_to_pfn(virt_to_page(buf->virt_addr)) + (pos >> PAGE_SHIFT);
+	if (!IS_ALIGNED(pfn, PMD_SIZE >> PAGE_SHIFT))
+		return VM_FAULT_FALLBACK;
+
+	return vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(pfn),
+				  vmf->flags & FAULT_FLAG_WRITE);
+}
+#endif
+
+/* cached buffers are mapped on fault, with 2MB pages where possible */
+static const struct vm_operations_struct pciep_cached_vm_ops = {
+	.open  = pciep_vm_open,
+	.close = pciep_vm_close,
+	.fault = pciep_vm_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	.huge_fault = pciep_vm_huge_fault,
+#endif
+};
+
+/**
+ * pciep_driver_file_get_unmapped_area() - Pick the address of a mapping.
+ * @file:	Pointer to the file structure.
+ * @addr:	Address hint.
+ * @len:	Size of the mapping.
+ * @pgoff:	Page offset of the mapping.
+ * @flags:	mmap() flags.
+ * Return:	Address of the mapping or error status.
+ *
+ * Mappings of 2MB and more start on a 2MB boundary, for
+ * pciep_vm_huge_fault() to map them with huge pages.
+ */
+static unsigned long pciep_driver_file_get_unmapped_area(struct file *file,
+							 unsigned long addr,
+							 unsigned long len,
+							 unsigned long pgoff,
+							 unsigned long flags)
+{
+	unsigned long ret;
+
+	if (!IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE) || addr ||
+	    (flags & MAP_FIXED) || len < PMD_SIZE)
+		return pciep_get_unmapped_area(file, addr, len, pgoff, flags);
+
+	ret = pciep_get_unmapped_area(file, 0, len + PMD_SIZE, pgoff, flags);
+	if (IS_ERR_VALUE(ret))
+		return pciep_get_unmapped_area(file, addr, len, pgoff, flags);
+
+	return ALIGN(ret, PMD_SIZE);
+}
+
+/**
+ * pciep_driver_file_mmap() - This is the driver memory map function.
+ * @file:	Pointer to the file structure.
+ * @vma:        Pointer to the vm area structure.
+ * Return:      Success(=0) or error status(<0).
+ */
+static int pciep_driver_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	size_t len = vma->vm_end - vma->vm_start;
+	unsigned long pgoff = vma->vm_pgoff;
+	struct pciep_buffer *buf;
+	int ret = 0;
+	u64 pos;
+
+	if (len > this->size)
+		return -EINVAL;
+
+	/* this->lock keeps pciep_set_placement() from moving the pool */
+	mutex_lock(&this->lock);
+	/* the offset selects one buffer, see pciep_buffer_offset() */
+	buf = pciep_mmap_to_buffer(this, (u64)pgoff << PAGE_SHIFT, &pos);
+	if (READ_ONCE(this->dead)) {
+		ret = -ENODEV;
+	} else if (!buf || pos) {
+		ret = -EINVAL;
+	} else if (buf->cached) {
+		pciep_vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND |
+				   VM_DONTDUMP);
+		if (IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE) &&
+		    len >= PMD_SIZE)
+			pciep_vm_flags_set(vma, VM_HUGEPAGE);
+		vma->vm_ops = &pciep_cached_vm_ops;
+	} else {
+		vma->vm_pgoff = 0;
+		ret = dma_mmap_coherent(buf->dev, vma, buf->virt_addr,
+					buf->phys_addr, len);
+		vma->vm_pgoff = pgoff;
+		vma->vm_ops = &pciep_vm_ops;
+	}
+	if (!ret) {
+		vma->vm_private_data = this;
+		pciep_vm_open(vma);
+	}
+	mutex_unlock(&this->lock);
+
+	return ret;
+}
+
+static long __pciep_driver_file_ioctl(struct file *file, unsigned int cmd,
+				      unsigned long arg)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	unsigned int value;
+	u64 value1;
+	u64 size;
+	struct enc_params params;
+	struct stream_config config;
+	struct pipeline_config pipeline;
+	struct resolution res;
+	struct buffer_desc desc;
+	struct buffer_sync sync;
+	struct stream_qos qos;
+	struct pciep_path *path;
+	struct pciep_buffer *buf;
+	unsigned long flags;
+	int ret;
+
+	switch (cmd) {
+	case GET_FILE_LENGTH:
+		size = pciep_file_length(this);
+		ret = copy_to_user((u64 *) arg, &size, sizeof(size));
+		return ret;
+
+	case GET_ENC_PARAMS:
+		pciep_read_enc_params(this, &params);
+		ret = copy_to_user((struct enc_params *) arg, &params, sizeof(params));
+		return ret;
+
+	case GET_RESOLUTION:
+		value = reg_read(this, PCIRC_RAW_RESOLUTION);
+		res.width = (value>>WIDTH_SHIFT) & WIDTH_MASK;
+		res.height = (value>>HEIGHT_SHIFT) & HEIGHT_MASK;
+		ret = copy_to_user((struct resolution *) arg, &res, sizeof(res));
+		return ret;
+
+	case GET_MODE:
+		value = reg_read(this, PCIRC_USECASE_MODE);
+		value = (value >> USE_CASE_MODE_SHIFT) & USE_CASE_MODE_MASK;
+		ret = copy_to_user((u32 *) arg, &value, sizeof(value));
+		return ret;
+
+	case SET_READ_OFFSET:
+		ret = copy_from_user(&value1, (u64 *) arg, sizeof(value1));
+		pciep_stream_set_offset(stream, &this->read_path, value1);
+		return ret;
+
+	case SET_WRITE_OFFSET:
+		ret = copy_from_user(&value1, (u64 *) arg, sizeof(value1));
+		pciep_stream_set_offset(stream, &this->write_path, value1);
+		return ret;
+
+	case SET_READ_TRANSFER_DONE:
+		pciep_transfer_done(this, false, true);
+		return 0;
+
+	case SET_WRITE_TRANSFER_DONE:
+		pciep_transfer_done(this, true, true);
+		return 0;
+
+	case CLR_READ_TRANSFER_DONE:
+		pciep_transfer_done(this, false, false);
+		return 0;
+
+	case CLR_WRITE_TRANSFER_DONE:
+		pciep_transfer_done(this, true, false);
+		return 0;
+
+	case GET_FPS:
+		value = reg_read(this, PCIRC_USECASE_MODE);
+		value = (value >> FPS_SHIFT) & FPS_MASK;
+		ret = copy_to_user((u32 *) arg, &value, sizeof(value));
+		return ret;
+
+	case GET_FORMAT:
+		value = reg_read(this, PCIRC_USECASE_MODE);
+		value = (value >> FORMAT_SHIFT) & FORMAT_MASK;
+		ret = copy_to_user((u32 *) arg, &value, sizeof(value));
+		return ret;
+
+	case QUERY_BUF:
+		if (copy_from_user(&desc, (struct buffer_desc *) arg,
+				   sizeof(desc)))
+			return -EFAULT;
+		path = pciep_desc_to_path(this, &desc);
+		if (!path)
+			return -EINVAL;
+		spin_lock_irqsave(&path->lock, flags);
+		buf = pciep_desc_to_buffer(this, &desc, &path);
+		if (buf) {
+			desc.length = buf->size;
+			desc.offset = buf->dmabuf ? 0 :
+				      pciep_buffer_offset(this, path, buf);
+		}
+		spin_unlock_irqrestore(&path->lock, flags);
+		if (!buf)
+			return -EINVAL;
+		desc.bytesused = 0;
+		ret = copy_to_user((struct buffer_desc *) arg, &desc,
+				   sizeof(desc));
+		return ret;
+
+	case QUEUE_BUF:
+		if (copy_from_user(&desc, (struct buffer_desc *) arg,
+				   sizeof(desc)))
+			return -EFAULT;
+		return pciep_queue_buf(this, file, &desc);
+
+	case DEQUEUE_BUF:
+		if (copy_from_user(&desc, (struct buffer_desc *) arg,
+				   sizeof(desc)))
+			return -EFAULT;
+		ret = pciep_dequeue_buf(this, file, &desc);
+		if (ret)
+			return ret;
+		ret = copy_to_user((struct buffer_desc *) arg, &desc,
+				   sizeof(desc));
+		return ret;
+
+	case EXPORT_BUF:
+		if (copy_from_user(&desc, (struct buffer_desc *) arg,
+				   sizeof(desc)))
+			return -EFAULT;
+		ret = pciep_export_buf(this, file, &desc);
+		if (ret)
+			return ret;
+		ret = copy_to_user((struct buffer_desc *) arg, &desc,
+				   sizeof(desc));
+		return ret;
+
+	case IMPORT_BUF:
+		if (copy_from_user(&desc, (struct buffer_desc *) arg,
+				   sizeof(desc)))
+			return -EFAULT;
+		ret = pciep_import_buf(this, file, &desc);
+		if (ret)
+			return ret;
+		ret = copy_to_user((struct buffer_desc *) arg, &desc,
+				   sizeof(desc));
+		return ret;
+
+	case UNIMPORT_BUF:
+		if (copy_from_user(&desc, (struct buffer_desc *) arg,
+				   sizeof(desc)))
+			return -EFAULT;
+		return pciep_unimport_buf(this, file, &desc);
+
+	case SET_BUF_PLACEMENT:
+		if (copy_from_user(&value, (u32 *) arg, sizeof(value)))
+			return -EFAULT;
+		return pciep_set_placement(this, value);
+
+	case GET_BUF_PLACEMENT:
+		value = READ_ONCE(this->placement);
+		ret = copy_to_user((u32 *) arg, &value, sizeof(value));
+		return ret;
+
+	case SET_IRQ_AFFINITY:
+		if (copy_from_user(&value, (u32 *) arg, sizeof(value)))
+			return -EFAULT;
+		return pciep_set_irq_affinity(this, value);
+
+	case GET_STREAM_CONFIG:
+		pciep_get_config(this, &config);
+		WRITE_ONCE(stream->config_gen, config.generation);
+		ret = copy_to_user((struct stream_config *) arg, &config,
+				   sizeof(config));
+		return ret;
+
+	case SET_TRANSFER_TIMEOUT:
+		if (copy_from_user(&value, (u32 *) arg, sizeof(value)))
+			return -EFAULT;
+		WRITE_ONCE(stream->timeout_ms, value);
+		return 0;
+
+	case CANCEL_TRANSFERS:
+		if (copy_from_user(&value, (u32 *) arg, sizeof(value)))
+			return -EFAULT;
+		return pciep_stream_cancel(stream, value);
+
+	case START_FILE_STREAM:
+		if (copy_from_user(&value, (u32 *) arg, sizeof(value)))
+			return -EFAULT;
+		return pciep_file_stream_start(file, value);
+
+	case STOP_FILE_STREAM:
+		pciep_file_stream_stop(file);
+		return 0;
+
+	case START_PIPELINE:
+		if (copy_from_user(&pipeline, (struct pipeline_config *) arg,
+				   sizeof(pipeline)))
+			return -EFAULT;
+		ret = pciep_pipeline_start(file, &pipeline);
+		if (ret)
+			return ret;
+		ret = copy_to_user((struct pipeline_config *) arg, &pipeline,
+				   sizeof(pipeline));
+		return ret;
+
+	case STOP_PIPELINE:
+		return pciep_pipeline_stop(file);
+
+	case SET_BUF_CACHE:
+		if (copy_from_user(&value, (u32 *) arg, sizeof(value)))
+			return -EFAULT;
+		return pciep_set_cache(this, value);
+
+	case GET_BUF_CACHE:
+		value = pciep_get_cache(this);
+		ret = copy_to_user((u32 *) arg, &value, sizeof(value));
+		return ret;
+
+	case SYNC_BUF:
+		if (copy_from_user(&sync, (struct buffer_sync *) arg,
+				   sizeof(sync)))
+			return -EFAULT;
+		return pciep_sync_buf(this, &sync);
+
+	case SET_STREAM_QOS:
+		if (copy_from_user(&qos, (struct stream_qos *) arg,
+				   sizeof(qos)))
+			return -EFAULT;
+		return pciep_stream_set_qos(stream, &qos);
+
+	case GET_STREAM_QOS:
+		memset(&qos, 0, sizeof(qos));
+		qos.prio_class = READ_ONCE(stream->qos_class);
+		qos.weight = READ_ONCE(stream->qos_weight);
+		qos.max_rate = READ_ONCE(stream->qos_rate);
+		ret = copy_to_user((struct stream_qos *) arg, &qos,
+				   sizeof(qos));
+		return ret;
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+/**
+ * pciep_read_nonblock() - One step of a non-blocking read.
+ * @file:	Pointer to the file structure.
+ * @count:	The number of bytes to be read.
+ * Return:	The completed buffer to copy out, or ERR_PTR(-EAGAIN) once a
+ *		buffer is armed, POLLIN then tells when the next call can
+ *		take it.
+ */
+static struct pciep_buffer *pciep_read_nonblock(struct file *file,
+						size_t count)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	struct pciep_path *path = &this->read_path;
+	struct pciep_buffer *buf;
+	bool pending;
+
+	if (count > this->size)
+		return ERR_PTR(-EINVAL);
+	buf = pciep_path_dequeue(path, file, true, &pending);
+	if (buf)
+		return buf;
+	if (pending)
+		return ERR_PTR(-EAGAIN);
+	buf = pciep_buffer_take(path);
+	if (!buf)
+		return ERR_PTR(-EAGAIN);
+	buf->owner = file;
+	buf->rw = true;
+	pciep_path_queue(this, path, buf, stream, count,
+			 READ_ONCE(stream->read_offset));
+	return ERR_PTR(-EAGAIN);
+}
+
+/**
+ * pciep_iter_user_addr() - Start of a single segment user iterator.
+ * @it:		Iterator passed to read_iter()/write_iter().
+ * @addr:	Returns the user address.
+ * Return:	Whether @it is one contiguous range of user memory.
+ */
+static bool pciep_iter_user_addr(struct iov_iter *it, unsigned long *addr)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	if (!iter_is_ubuf(it) && !(iter_is_iovec(it) && it->nr_segs == 1))
+		return false;
+	*addr = (unsigned long)iter_iov_addr(it);
+#else
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	if (iter_is_ubuf(it)) {
+		*addr = (unsigned long)it->ubuf + it->iov_offset;
+		return true;
+	}
+#endif
+	if (!iter_is_iovec(it) || it->nr_segs != 1)
+		return false;
+	*addr = (unsigned long)it->iov->iov_base + it->iov_offset;
+#endif
+	return true;
+}
+
+/**
+ * pciep_iter_to_pool() - Take the pool buffer a user iterator maps.
+ * @this:	Pointer to the pciep driver data structure.
+ * @path:	Path the transfer belongs to.
+ * @file:	File the transfer is made on.
+ * @it:		Iterator passed to read_iter()/write_iter().
+ * @count:	The number of bytes to be transferred.
+ * Return:	The buffer, taken out of the pool, NULL if @it is not an
+ *		mmap() of a pool buffer, or ERR_PTR().
+ *
+ * A transfer on memory mmap()ed from the pool needs no bounce at all, the
+ * endpoint reads or writes the pool buffer in place. It has to start at
+ * the start of the buffer, which is the only address the endpoint takes.
+ *
+ * A buffer armed by an earlier non-blocking call of @file is returned
+ * once done, still marked rw, and is -EAGAIN while in flight.
+ */
+static struct pciep_buffer *pciep_iter_to_pool(struct pciep_driver_data *this,
+					       struct pciep_path *path,
+					       struct file *file,
+					       struct iov_iter *it,
+					       size_t count)
+{
+	struct mm_struct *mm = current->mm;
+	struct pciep_buffer *buf;
+	struct vm_area_struct *vma;
+	unsigned long addr, flags;
+	bool found;
+	u64 offset;
+	u64 pos;
+
+	if (!pciep_iter_user_addr(it, &addr))
+		return NULL;
+
+	mmap_read_lock(mm);
+	vma = find_vma(mm, addr);
+	found = vma && vma->vm_start <= addr && vma->vm_private_data == this &&
+		(vma->vm_ops == &pciep_vm_ops ||
+		 vma->vm_ops == &pciep_cached_vm_ops);
+	if (found)
+		offset = ((u64)vma->vm_pgoff << PAGE_SHIFT) +
+			 addr - vma->vm_start;
+	mmap_read_unlock(mm);
+	if (!found)
+		return NULL;
+
+	/*
+	 * this->lock keeps pciep_set_placement() from moving the pool. It
+	 * nests inside mmap_lock, see pciep_driver_file_mmap(), so it is
+	 * only taken once the mapping has been looked up.
+	 */
+	mutex_lock(&this->lock);
+	buf = pciep_mmap_to_buffer(this, offset, &pos);
+	if (!buf || pos || count > buf->size || buf < path->bufs ||
+	    buf >= path->bufs + this->num_bufs) {
+		buf = ERR_PTR(-EINVAL);
+		goto out;
+	}
+	spin_lock_irqsave(&path->lock, flags);
+	if (buf->state == PCIEP_BUF_FREE) {
+		list_del(&buf->list);
+		buf->state = PCIEP_BUF_USER;
+	} else if (!buf->rw || buf->owner != file) {
+		buf = ERR_PTR(-EBUSY);
+	} else if (buf->state == PCIEP_BUF_DONE) {
+		list_del(&buf->list);
+		buf->state = PCIEP_BUF_USER;
+	} else {
+		buf = ERR_PTR(-EAGAIN);
+	}
+	spin_unlock_irqrestore(&path->lock, flags);
+out:
+	mutex_unlock(&this->lock);
+
+	return buf;
+}
+
+/**
+ * pciep_iocb_queue() - Queue a pool buffer for read_iter()/write_iter().
+ * @iocb:	I/O control block.
+ * @path:	Path the transfer belongs to.
+ * @buf:	Pool buffer holding or receiving the data.
+ * @count:	The number of bytes to be transferred.
+ * @offset:	Host offset of the transfer.
+ * Return:	-EIOCBQUEUED for an asynchronous @iocb, completed from the
+ *		interrupt thread, else the transferred size or error
+ *		status(<0) once done.
+ *
+ * An asynchronous @iocb has nobody to interrupt its wait: it times out
+ * after the deadline of the stream, DEFAULT_IOCB_TIMEOUT_MS if it has
+ * none, and can be cancelled through aio. CANCEL_TRANSFERS ends it too.
+ */
+static ssize_t pciep_iocb_queue(struct kiocb *iocb, struct pciep_path *path,
+				struct pciep_buffer *buf, size_t count,
+				u64 offset)
+{
+	struct pciep_stream *stream = iocb->ki_filp->private_data;
+	struct pciep_driver_data *this = stream->this;
+	unsigned int msecs = READ_ONCE(stream->timeout_ms);
+	unsigned long flags;
+	ktime_t deadline;
+	int ret;
+
+	if (!is_sync_kiocb(iocb)) {
+		buf->iocb = iocb;
+		buf->complete = pciep_is_write(this, path) ?
+				pciep_iocb_write_complete :
+				pciep_iocb_read_complete;
+		buf->deadline = ktime_add_ms(ktime_get(),
+					     msecs ?: DEFAULT_IOCB_TIMEOUT_MS);
+		iocb->private = buf;
+		pciep_set_cancel_fn(iocb, pciep_iocb_cancel);
+		pciep_path_queue(this, path, buf, stream, count, offset);
+
+		/*
+		 * May be done by now, a stale deadline only brings the timer
+		 * round early. A cancel before the queue is caught here, the
+		 * kiocb is alive as long as the buffer is queued for it.
+		 */
+		spin_lock_irqsave(&path->lock, flags);
+		deadline = buf->deadline;
+		if (buf->iocb == iocb && pciep_iocb_cancelled(iocb))
+			deadline = ktime_get();
+		if (!hrtimer_is_queued(&path->iocb_timer) ||
+		    ktime_before(deadline,
+				 hrtimer_get_expires(&path->iocb_timer)))
+			hrtimer_start(&path->iocb_timer, deadline,
+				      HRTIMER_MODE_ABS);
+		spin_unlock_irqrestore(&path->lock, flags);
+		return -EIOCBQUEUED;
+	}
+
+	pciep_path_queue(this, path, buf, stream, count, offset);
+	ret = pciep_path_wait(stream, path, buf, 1);
+	if (!ret && !pciep_is_write(this, path))
+		pciep_buffer_sync(buf, 0, count, true);
+	pciep_buffer_put(this, path, buf);
+
+	return ret ? ret : count;
+}
+
+/**
+ * __pciep_driver_file_read() - This is the driver read function.
+ * @file:	Pointer to the file structure.
+ * @buff:	Pointer to the user buffer.
+ * @count:	The number of bytes to be written.
+ * @ppos:	Pointer to the offset value.
+ * Return:	Transferred size.
+ */
+static ssize_t __pciep_driver_file_read(struct file *file, char __user *buff,
+					size_t count, loff_t *ppos)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	struct pciep_path *path = &this->read_path;
+	u64 offset = READ_ONCE(stream->read_offset);
+	struct pciep_buffer *buf;
+	int ret;
+
+	/* check the size */
+	if (count <= 0)
+		return -EINVAL;
+
+	if (READ_ONCE(stream->engine) == PCIEP_ENGINE_FILE)
+		return pciep_file_stream_read(file, buff, count);
+
+	/*
+	 * Non-blocking: the first call arms a pool buffer and returns
+	 * -EAGAIN, POLLIN then tells when the next call can copy it out.
+	 */
+	if (file->f_flags & O_NONBLOCK) {
+		buf = pciep_read_nonblock(file, count);
+		if (IS_ERR(buf))
+			return PTR_ERR(buf);
+		count = min(count, buf->bytesused);
+		pciep_buffer_sync(buf, 0, count, true);
+		ret = copy_to_user(buff, buf->virt_addr, count);
+		trace_pciep_copy_done(pciep_minor(this), false, count, ret);
+		pciep_buffer_put(this, path, buf);
+		return ret;
+	}
+
+	if (direct_io_threshold && count >= direct_io_threshold)
+		return pciep_direct_io(stream, path, (unsigned long)buff, count,
+				       offset, true);
+
+	/* take a pool buffer, or allocate one for oversized transfers */
+	buf = pciep_buffer_get(stream, &this->read_path, count);
+	if (!buf)
+		return -ENOMEM;
+
+	pciep_path_queue(this, &this->read_path, buf, stream, count, offset);
+	ret = pciep_path_wait(stream, &this->read_path, buf, 1);
+	if (ret)
+		goto out;
+
+	pciep_buffer_sync(buf, 0, count, true);
+	ret = copy_to_user(buff, buf->virt_addr, count);
+	trace_pciep_copy_done(pciep_minor(this), false, count, ret);
+out:
+	/* hand the buffer back to the pool or keep it for the next one */
+	pciep_stream_buffer_put(stream, &this->read_path, buf);
+
+	return ret;
+}
+
+/**
+ * __pciep_driver_file_write() - This is the driver write function.
+ * @file:	Pointer to the file structure.
+ * @buff:	Pointer to the user buffer.
+ * @count:	The number of bytes to be written.
+ * @ppos:	Pointer to the offset value
+ * Return:	Transferred size.
+ */
+static ssize_t __pciep_driver_file_write(struct file *file,
+					 const char __user *buff,
+					 size_t count, loff_t *ppos)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	u64 offset = READ_ONCE(stream->write_offset);
+	struct pciep_buffer *buf;
+	int ret;
+
+	/* check the size */
+	if (count <= 0)
+		return -EINVAL;
+
+	/*
+	 * Non-blocking: queue a pool buffer and return, nobody waits for
+	 * it so it goes straight back to the pool when the host is done.
+	 */
+	if (file->f_flags & O_NONBLOCK) {
+		if (count > this->size)
+			return -EINVAL;
+		buf = pciep_buffer_take(&this->write_path);
+		if (!buf)
+			return -EAGAIN;
+		ret = copy_from_user(buf->virt_addr, buff, count);
+		trace_pciep_copy_done(pciep_minor(this), true, count, ret);
+		if (ret) {
+			pciep_buffer_put(this, &this->write_path, buf);
+			return ret;
+		}
+		buf->orphan = true;
+		pciep_path_queue(this, &this->write_path, buf, stream, count,
+				 offset);
+		return 0;
+	}
+
+	if (direct_io_threshold && count >= direct_io_threshold)
+		return pciep_direct_io(stream, &this->write_path,
+				       (unsigned long)buff, count, offset, false);
+
+	/* take a pool buffer, or allocate one for oversized transfers */
+	buf = pciep_buffer_get(stream, &this->write_path, count);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = copy_from_user(buf->virt_addr, buff, count);
+	trace_pciep_copy_done(pciep_minor(this), true, count, ret);
+	if (ret)
+		goto out;
+
+	pciep_path_queue(this, &this->write_path, buf, stream, count, offset);
+	ret = pciep_path_wait(stream, &this->write_path, buf, 1);
+out:
+	/* hand the buffer back to the pool or keep it for the next one */
+	pciep_stream_buffer_put(stream, &this->write_path, buf);
+
+	return ret;
+}
+
+/**
+ * __pciep_driver_file_read_iter() - This is the driver vectored read function.
+ * @iocb:	I/O control block.
+ * @to:		Destination iterator, one segment per plane.
+ * Return:	Transferred size or error status(<0).
+ *
+ * All the planes of a frame are transferred in one endpoint handshake at
+ * the current read offset and scattered to the user segments afterwards.
+ *
+ * A read into an mmap() of a read pool buffer is done in place, and
+ * completes asynchronously for io_uring and aio. Any other read has to be
+ * copied out in the caller's context. With IOCB_NOWAIT or O_NONBLOCK a
+ * synchronous read goes through the same two steps as a non-blocking
+ * read(), in place or not: the first call arms the buffer and returns
+ * -EAGAIN, the call after POLLIN returns the data.
+ */
+static ssize_t __pciep_driver_file_read_iter(struct kiocb *iocb,
+					     struct iov_iter *to)
+{
+	struct file *file = iocb->ki_filp;
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	bool nowait = (iocb->ki_flags & IOCB_NOWAIT) ||
+		      (file->f_flags & O_NONBLOCK);
+	size_t count = iov_iter_count(to);
+	struct pciep_buffer *buf;
+	size_t copied;
+	ssize_t ret;
+
+	if (!count)
+		return -EINVAL;
+
+	buf = pciep_iter_to_pool(this, &this->read_path, file, to, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+	if (buf && buf->rw) {
+		/* armed by the previous non-blocking call, done by now */
+		count = min(count, buf->bytesused);
+		pciep_buffer_sync(buf, 0, count, true);
+		iov_iter_advance(to, count);
+		pciep_buffer_put(this, &this->read_path, buf);
+		return count;
+	}
+	if (buf && is_sync_kiocb(iocb) && nowait) {
+		buf->owner = file;
+		buf->rw = true;
+		pciep_path_queue(this, &this->read_path, buf, stream, count,
+				 READ_ONCE(stream->read_offset));
+		return -EAGAIN;
+	}
+	if (buf) {
+		/* before the queue, an async completion may end the iocb */
+		iov_iter_advance(to, count);
+		return pciep_iocb_queue(iocb, &this->read_path, buf, count,
+					READ_ONCE(stream->read_offset));
+	}
+
+	if (nowait) {
+		buf = pciep_read_nonblock(file, count);
+		if (IS_ERR(buf))
+			return PTR_ERR(buf);
+		count = min(count, buf->bytesused);
+		pciep_buffer_sync(buf, 0, count, true);
+		copied = copy_to_iter(buf->virt_addr, count, to);
+		trace_pciep_copy_done(pciep_minor(this), false, count,
+				      count - copied);
+		pciep_buffer_put(this, &this->read_path, buf);
+		return copied ? copied : -EFAULT;
+	}
+
+	buf = pciep_buffer_get(stream, &this->read_path, count);
+	if (!buf)
+		return -ENOMEM;
+
+	pciep_path_queue(this, &this->read_path, buf, stream, count,
+			 READ_ONCE(stream->read_offset));
+	ret = pciep_path_wait(stream, &this->read_path, buf, 1);
+	if (ret) {
+		pciep_stream_buffer_put(stream, &this->read_path, buf);
+		return ret;
+	}
+
+	pciep_buffer_sync(buf, 0, count, true);
+	copied = copy_to_iter(buf->virt_addr, count, to);
+	trace_pciep_copy_done(pciep_minor(this), false, count, count - copied);
+
+	pciep_stream_buffer_put(stream, &this->read_path, buf);
+
+	return copied ? copied : -EFAULT;
+}
+
+/**
+ * __pciep_driver_file_write_iter() - This is the driver vectored write function.
+ * @iocb:	I/O control block.
+ * @from:	Source iterator, one segment per plane.
+ * Return:	Transferred size or error status(<0).
+ *
+ * The user segments are gathered into one buffer and sent in one
+ * endpoint handshake at the current write offset.
+ *
+ * A write from an mmap() of a write pool buffer is sent in place. Writes
+ * of io_uring and aio fitting into a pool buffer complete asynchronously,
+ * from the interrupt thread. With IOCB_NOWAIT or O_NONBLOCK a synchronous
+ * write is queued and returns right away, in place or not, and one
+ * arriving while the pool is exhausted returns -EAGAIN, POLLOUT telling
+ * when one is free again.
+ */
+static ssize_t __pciep_driver_file_write_iter(struct kiocb *iocb,
+					      struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	struct pciep_path *path = &this->write_path;
+	bool nowait = (iocb->ki_flags & IOCB_NOWAIT) ||
+		      (file->f_flags & O_NONBLOCK);
+	u64 offset = READ_ONCE(stream->write_offset);
+	size_t count = iov_iter_count(from);
+	struct pciep_buffer *buf;
+	ssize_t ret = count;
+	size_t copied;
+	int status;
+
+	if (!count)
+		return -EINVAL;
+
+	buf = pciep_iter_to_pool(this, path, file, from, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+	if (buf) {
+		/* before the queue, an async completion may end the iocb */
+		iov_iter_advance(from, count);
+		if (!is_sync_kiocb(iocb) || !nowait)
+			return pciep_iocb_queue(iocb, path, buf, count, offset);
+		/* like a non-blocking write(), nobody waits for it */
+		buf->orphan = true;
+		pciep_path_queue(this, path, buf, stream, count, offset);
+		return count;
+	}
+
+	if (nowait && count > this->size)
+		return -EINVAL;
+	if (nowait || (!is_sync_kiocb(iocb) && count <= this->size)) {
+		buf = pciep_buffer_take(path);
+		if (!buf && nowait)
+			return -EAGAIN;
+	}
+	if (buf) {
+		copied = copy_from_iter(buf->virt_addr, count, from);
+		trace_pciep_copy_done(pciep_minor(this), true, count,
+				      count - copied);
+		if (copied != count) {
+			pciep_buffer_put(this, path, buf);
+			return -EFAULT;
+		}
+		if (!is_sync_kiocb(iocb))
+			return pciep_iocb_queue(iocb, path, buf, count, offset);
+		/* like a non-blocking write(), nobody waits for it */
+		buf->orphan = true;
+		pciep_path_queue(this, path, buf, stream, count, offset);
+		return count;
+	}
+
+	buf = pciep_buffer_get(stream, &this->write_path, count);
+	if (!buf)
+		return -ENOMEM;
+
+	copied = copy_from_iter(buf->virt_addr, count, from);
+	trace_pciep_copy_done(pciep_minor(this), true, count, count - copied);
+	if (copied != count) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	pciep_path_queue(this, &this->write_path, buf, stream, count,
+			 READ_ONCE(stream->write_offset));
+	status = pciep_path_wait(stream, &this->write_path, buf, 1);
+	if (status)
+		ret = status;
+out:
+	pciep_stream_buffer_put(stream, &this->write_path, buf);
+
+	return ret;
+}
+
+/*
+ * The file operations below may touch the registers and run with the
+ * endpoint runtime resumed, see pciep_pm_get().
+ */
+static long pciep_driver_file_ioctl(struct file *file, unsigned int cmd,
+				    unsigned long arg)
+{
+	struct pciep_stream *stream = file->private_data;
+	long ret;
+
+	ret = pciep_pm_get(stream->this);
+	if (ret)
+		return ret;
+	ret = __pciep_driver_file_ioctl(file, cmd, arg);
+	pciep_pm_put(stream->this);
+
+	return ret;
+}
+
+static ssize_t pciep_driver_file_read(struct file *file, char __user *buff,
+				      size_t count, loff_t *ppos)
+{
+	struct pciep_stream *stream = file->private_data;
+	ssize_t ret;
+
+	ret = pciep_pm_get(stream->this);
+	if (ret)
+		return ret;
+	ret = __pciep_driver_file_read(file, buff, count, ppos);
+	pciep_pm_put(stream->this);
+
+	return ret;
+}
+
+static ssize_t pciep_driver_file_write(struct file *file,
+				       const char __user *buff,
+				       size_t count, loff_t *ppos)
+{
+	struct pciep_stream *stream = file->private_data;
+	ssize_t ret;
+
+	ret = pciep_pm_get(stream->this);
+	if (ret)
+		return ret;
+	ret = __pciep_driver_file_write(file, buff, count, ppos);
+	pciep_pm_put(stream->this);
+
+	return ret;
+}
+
+static ssize_t pciep_driver_file_read_iter(struct kiocb *iocb,
+					   struct iov_iter *to)
+{
+	struct pciep_stream *stream = iocb->ki_filp->private_data;
+	ssize_t ret;
+
+	ret = pciep_pm_get(stream->this);
+	if (ret)
+		return ret;
+	ret = __pciep_driver_file_read_iter(iocb, to);
+	pciep_pm_put(stream->this);
+
+	return ret;
+}
+
+static ssize_t pciep_driver_file_write_iter(struct kiocb *iocb,
+					    struct iov_iter *from)
+{
+	struct pciep_stream *stream = iocb->ki_filp->private_data;
+	ssize_t ret;
+
+	ret = pciep_pm_get(stream->this);
+	if (ret)
+		return ret;
+	ret = __pciep_driver_file_write_iter(iocb, from);
+	pciep_pm_put(stream->this);
+
+	return ret;
+}
+
+static loff_t pciep_driver_file_lseek(struct file *file,loff_t offset, int orig)
+{
+	struct pciep_stream *stream = file->private_data;
+	int ret;
+
+	ret = pciep_pm_get(stream->this);
+	if (ret)
+		return ret;
+	pciep_stream_set_offset(stream, &stream->this->read_path, offset);
+	pciep_pm_put(stream->this);
+
+	return offset;
+}
+
+/**
+ * pciep_driver_file_poll() - This is the driver poll function.
+ * @file:	Pointer to the file structure.
+ * @wait:	Poll table.
+ * Return:	POLLIN when a read buffer of this file completed, POLLOUT when
+ *		a write buffer of this file completed or a free write buffer
+ *		is available, POLLPRI when the host configuration changed
+ *		since the last GET_STREAM_CONFIG of this file, POLLERR and
+ *		POLLHUP once the device is removed.
+ */
+static __poll_t pciep_driver_file_poll(struct file *file, poll_table *wait)
+{
+	struct pciep_stream *stream = file->private_data;
+	struct pciep_driver_data *this = stream->this;
+	__poll_t mask = 0;
+
+	poll_wait(file, &this->read_path.wait, wait);
+	poll_wait(file, &this->write_path.wait, wait);
+	poll_wait(file, &this->config_wait, wait);
+
+	if (READ_ONCE(this->dead))
+		return EPOLLERR | EPOLLHUP;
+	if (pciep_path_poll(&this->read_path, file, false))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	/* a partly consumed chunk, or the end of a streamed file */
+	if (READ_ONCE(stream->engine) == PCIEP_ENGINE_FILE &&
+	    (READ_ONCE(stream->file_cur) ||
+	     READ_ONCE(stream->file_pos) == READ_ONCE(stream->file_len)))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (pciep_path_poll(&this->write_path, file, true))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	if (READ_ONCE(this->config.generation) != READ_ONCE(stream->config_gen))
+		mask |= EPOLLPRI;
+
+	return mask;
+}
+
+static const struct file_operations pciep_driver_file_ops = {
+	.owner   = THIS_MODULE,
 	.open    = pciep_driver_file_open,
 	.release = pciep_driver_file_release,
 	.mmap    = pciep_driver_file_mmap,
+	.get_unmapped_area = pciep_driver_file_get_unmapped_area,
 	.read    = pciep_driver_file_read,
 	.write   = pciep_driver_file_write,
+	.read_iter  = pciep_driver_file_read_iter,
+	.write_iter = pciep_driver_file_write_iter,
 	.llseek  = pciep_driver_file_lseek,
+	.poll    = pciep_driver_file_poll,
 	.unlocked_ioctl = pciep_driver_file_ioctl,
 };
 
+/**
+ * pciep_host_done() - Handle a host done event.
+ * @this:	Pointer to the pciep driver data structure.
+ *
+ * The host is done with both directions, clear the transfer done flags and
+ * pick up the configuration it may have changed.
+ */
+static void pciep_host_done(struct pciep_driver_data *this)
+{
+	pciep_transfer_done(this, false, false);
+	pciep_transfer_done(this, true, false);
+	pciep_refresh_config(this);
+}
+
+/*
+ * The host done line fired while suspended and was masked, the resume
+ * acks and handles a host done that came in meanwhile.
+ */
+static void pciep_host_done_resume(struct work_struct *work)
+{
+	struct pciep_driver_data *this = container_of(work,
+						      struct pciep_driver_data,
+						      host_done_work);
+
+	pm_runtime_get_sync(this->dma_dev);
+	enable_irq(this->host_done_irq);
+	__pciep_pm_put(this);
+}
+
+/* fault injection, hold a completion back in the interrupt thread */
+static void pciep_fail_delay(struct pciep_driver_data *this)
+{
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+	if (pciep_should_fail(this, fail_delay))
+		msleep(READ_ONCE(this->fail_delay_ms));
+#endif
+}
+
+/* fault injection, a host done racing the transfer programmed next */
+static void pciep_fail_host_done(struct pciep_driver_data *this)
+{
+	if (pciep_should_fail(this, fail_host_done)) {
+		WRITE_ONCE(this->host_done_time, ktime_get());
+		pciep_host_done(this);
+	}
+}
+
+/**
+ * xilinx_pciep_read_irq_handler - Interrupt handler
+ * @irq: IRQ number
+ * @data: Pointer to the driver data structure
+ *
+ * Only acknowledges the interrupt, the line may be shared and reading the
+ * status register is both the check and the ack.
+ *
+ * Return: IRQ_WAKE_THREAD/IRQ_NONE
+ */
+static irqreturn_t xilinx_pciep_read_irq_handler(int irq, void *data)
+{
+	struct pciep_driver_data *driver_data = data;
+
+	/* a shared line may fire while the register block is gated */
+	if (READ_ONCE(driver_data->suspended))
+		return IRQ_NONE;
+	if (!reg_read(driver_data, PCIRC_READ_BUFFER_TRANSFER_DONE_INTR)) {
+		this_cpu_inc(driver_data->stats->read.spurious_irqs);
+		return IRQ_NONE;
+	}
+	/* the read above acked it, the completion is lost */
+	if (pciep_should_fail(driver_data, fail_irq))
+		return IRQ_HANDLED;
+	/* as close to the wire as the driver gets, before the thread runs */
+	WRITE_ONCE(driver_data->read_path.irq_time, ktime_get());
+	this_cpu_inc(driver_data->stats->read.irqs);
+	trace_pciep_irq(pciep_minor(driver_data), false);
+
+	return IRQ_WAKE_THREAD;
+}
+
+/**
+ * xilinx_pciep_read_irq_thread - Interrupt thread
+ * @irq: IRQ number
+ * @data: Pointer to the driver data structure
+ *
+ * Return: IRQ_HANDLED
+ */
+static irqreturn_t xilinx_pciep_read_irq_thread(int irq, void *data)
+{
+	struct pciep_driver_data *driver_data = data;
+
+	pciep_fail_delay(driver_data);
+	pciep_path_retire(driver_data, &driver_data->read_path);
+	pciep_fail_host_done(driver_data);
+
+	return IRQ_HANDLED;
+}
+
+/**
+ * xilinx_pciep_write_irq_handler - Interrupt handler
+ * @irq: IRQ number
+ * @data: Pointer to the driver data structure
+ *
+ * Return: IRQ_WAKE_THREAD/IRQ_NONE
+ */
+static irqreturn_t xilinx_pciep_write_irq_handler(int irq, void *data)
+{
+	struct pciep_driver_data *driver_data = data;
+
+	/* a shared line may fire while the register block is gated */
+	if (READ_ONCE(driver_data->suspended))
+		return IRQ_NONE;
+	if (!reg_read(driver_data, PCIRC_WRITE_BUFFER_TRANSFER_DONE_INTR)) {
+		this_cpu_inc(driver_data->stats->write.spurious_irqs);
+		return IRQ_NONE;
+	}
+	/* the read above acked it, the completion is lost */
+	if (pciep_should_fail(driver_data, fail_irq))
+		return IRQ_HANDLED;
+	/* as close to the wire as the driver gets, before the thread runs */
+	WRITE_ONCE(driver_data->write_path.irq_time, ktime_get());
+	this_cpu_inc(driver_data->stats->write.irqs);
+	trace_pciep_irq(pciep_minor(driver_data), true);
+
+	return IRQ_WAKE_THREAD;
+}
+
+/**
+ * xilinx_pciep_write_irq_thread - Interrupt thread
+ * @irq: IRQ number
+ * @data: Pointer to the driver data structure
+ *
+ * Return: IRQ_HANDLED
+ */
+static irqreturn_t xilinx_pciep_write_irq_thread(int irq, void *data)
+{
+	struct pciep_driver_data *driver_data = data;
+
+	pciep_fail_delay(driver_data);
+	pciep_path_retire(driver_data, &driver_data->write_path);
+	pciep_fail_host_done(driver_data);
+
+	return IRQ_HANDLED;
+}
+
+/**
+ * xilinx_pciep_host_done_irq_handler - Interrupt handler
+ * @irq: IRQ number
+ * @data: Pointer to the driver data structure
+ *
+ * Return: IRQ_WAKE_THREAD/IRQ_NONE
+ */
+static irqreturn_t xilinx_pciep_host_done_irq_handler(int irq, void *data)
+{
+	struct pciep_driver_data *driver_data = data;
+
+	/*
+	 * The register block is gated, there is no telling whether the host
+	 * is done or another device on the line fired. Mask the line until
+	 * the endpoint is resumed to find out.
+	 */
+	if (READ_ONCE(driver_data->suspended)) {
+		disable_irq_nosync(irq);
+		schedule_work(&driver_data->host_done_work);
+		return IRQ_HANDLED;
+	}
+	if (!reg_read(driver_data, PCIRC_HOST_DONE_INTR)) {
+		this_cpu_inc(driver_data->stats->host_done_spurious_irqs);
+		return IRQ_NONE;
+	}
+	WRITE_ONCE(driver_data->host_done_time, ktime_get());
+	this_cpu_inc(driver_data->stats->host_done_irqs);
+	trace_pciep_host_done(pciep_minor(driver_data));
+
+	return IRQ_WAKE_THREAD;
+}
+
+/**
+ * xilinx_pciep_host_done_irq_thread - Interrupt thread
+ * @irq: IRQ number
+ * @data: Pointer to the driver data structure
+ *
+ * Return: IRQ_HANDLED
+ */
+static irqreturn_t xilinx_pciep_host_done_irq_thread(int irq, void *data)
+{
+	struct pciep_driver_data *driver_data = data;
+
+	pciep_host_done(driver_data);
+
+	return IRQ_HANDLED;
+}
+
+/**
+ * pciep_stat_sum() - Sum a counter over all CPUs.
+ * @stats:	Per-CPU counters.
+ * @offset:	Offset of the counter in struct pciep_stats.
+ * Return:	The total.
+ */
+static u64 pciep_stat_sum(struct pciep_stats __percpu *stats, size_t offset)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *(u64 *)((char *)per_cpu_ptr(stats, cpu) + offset);
+
+	return sum;
+}
+
+#define PCIEP_STAT_ATTR(_name, _field)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct pciep_driver_data *this = dev_get_drvdata(dev);		\
+									\
+	return sysfs_emit(buf, "%llu\n",				\
+			  pciep_stat_sum(this->stats,			\
+					 offsetof(struct pciep_stats,	\
+						  _field)));		\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+PCIEP_STAT_ATTR(read_bytes, read.bytes);
+PCIEP_STAT_ATTR(read_transfers, read.transfers);
+PCIEP_STAT_ATTR(read_alloc_failures, read.alloc_failures);
+PCIEP_STAT_ATTR(read_irqs, read.irqs);
+PCIEP_STAT_ATTR(read_spurious_irqs, read.spurious_irqs);
+PCIEP_STAT_ATTR(read_wait_ns, read.wait_ns);
+PCIEP_STAT_ATTR(read_aborted, read.aborted);
+PCIEP_STAT_ATTR(write_bytes, write.bytes);
+PCIEP_STAT_ATTR(write_transfers, write.transfers);
+PCIEP_STAT_ATTR(write_alloc_failures, write.alloc_failures);
+PCIEP_STAT_ATTR(write_irqs, write.irqs);
+PCIEP_STAT_ATTR(write_spurious_irqs, write.spurious_irqs);
+PCIEP_STAT_ATTR(write_wait_ns, write.wait_ns);
+PCIEP_STAT_ATTR(write_aborted, write.aborted);
+PCIEP_STAT_ATTR(host_done_irqs, host_done_irqs);
+PCIEP_STAT_ATTR(host_done_spurious_irqs, host_done_spurious_irqs);
+PCIEP_STAT_ATTR(pm_suspends, pm_suspends);
+PCIEP_STAT_ATTR(pm_suspend_ns, pm_suspend_ns);
+PCIEP_STAT_ATTR(pm_resumes, pm_resumes);
+PCIEP_STAT_ATTR(pm_resume_ns, pm_resume_ns);
+
+static ssize_t pm_resume_max_ns_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct pciep_driver_data *this = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%llu\n", READ_ONCE(this->pm_resume_max_ns));
+}
+static DEVICE_ATTR_RO(pm_resume_max_ns);
+
+static struct attribute *pciep_stats_attrs[] = {
+	&dev_attr_read_bytes.attr,
+	&dev_attr_read_transfers.attr,
+	&dev_attr_read_alloc_failures.attr,
+	&dev_attr_read_irqs.attr,
+	&dev_attr_read_spurious_irqs.attr,
+	&dev_attr_read_wait_ns.attr,
+	&dev_attr_read_aborted.attr,
+	&dev_attr_write_bytes.attr,
+	&dev_attr_write_transfers.attr,
+	&dev_attr_write_alloc_failures.attr,
+	&dev_attr_write_irqs.attr,
+	&dev_attr_write_spurious_irqs.attr,
+	&dev_attr_write_wait_ns.attr,
+	&dev_attr_write_aborted.attr,
+	&dev_attr_host_done_irqs.attr,
+	&dev_attr_host_done_spurious_irqs.attr,
+	&dev_attr_pm_suspends.attr,
+	&dev_attr_pm_suspend_ns.attr,
+	&dev_attr_pm_resumes.attr,
+	&dev_attr_pm_resume_ns.attr,
+	&dev_attr_pm_resume_max_ns.attr,
+	NULL,
+};
+
+static const struct attribute_group pciep_stats_group = {
+	.name  = "stats",
+	.attrs = pciep_stats_attrs,
+};
+
+static const struct attribute_group *pciep_groups[] = {
+	&pciep_stats_group,
+	NULL,
+};
+
+/* debugfs <dev>/<dir>_latency: one "<from>-<to> us: <count>" per bucket */
+static int pciep_latency_show(struct seq_file *s, void *unused)
+{
+	struct pciep_path *path = s->private;
+	u64 count[PCIEP_LATENCY_BUCKETS] = { };
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct pciep_path_stats *stats = per_cpu_ptr(path->stats, cpu);
+
+		for (i = 0; i < PCIEP_LATENCY_BUCKETS; i++)
+			count[i] += stats->latency[i];
+	}
+
+	seq_printf(s, "%10u-%-10u us: %llu\n", 0, 1, count[0]);
+	for (i = 1; i < PCIEP_LATENCY_BUCKETS - 1; i++)
+		seq_printf(s, "%10u-%-10u us: %llu\n", 1U << (i - 1), 1U << i,
+			   count[i]);
+	seq_printf(s, "%10u-%-10s us: %llu\n", 1U << (i - 1), "", count[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pciep_latency);
+
+static const char * const pciep_qos_names[PCIEP_QOS_CLASSES] = {
+	[QOS_CLASS_REALTIME] = "realtime",
+	[QOS_CLASS_NORMAL]   = "normal",
+	[QOS_CLASS_BULK]     = "bulk",
+};
+
+/* debugfs <dev>/<dir>_qos: transfers and mean time queued per class */
+static int pciep_qos_show(struct seq_file *s, void *unused)
+{
+	struct pciep_path *path = s->private;
+	u64 count[PCIEP_QOS_CLASSES] = { }, ns[PCIEP_QOS_CLASSES] = { };
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct pciep_path_stats *stats = per_cpu_ptr(path->stats, cpu);
+
+		for (i = 0; i < PCIEP_QOS_CLASSES; i++) {
+			count[i] += stats->qos_transfers[i];
+			ns[i] += stats->qos_delay_ns[i];
+		}
+	}
+
+	for (i = 0; i < PCIEP_QOS_CLASSES; i++)
+		seq_printf(s, "%-8s transfers: %llu queued: %llu ns avg\n",
+			   pciep_qos_names[i], count[i],
+			   count[i] ? div64_u64(ns[i], count[i]) : 0);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pciep_qos);
+
+/**
+ * pciep_fault_init() - Create the fault injection attributes of a device.
+ * @this:	Pointer to the pciep driver data structure.
+ *
+ * Each fail_* directory is a standard fault injection attribute, see
+ * Documentation/fault-injection/fault-injection.rst. All of them start
+ * disabled.
+ */
+static void pciep_fault_init(struct pciep_driver_data *this)
+{
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+	static const struct fault_attr init = FAULT_ATTR_INITIALIZER;
+
+	this->fail_irq = init;
+	this->fail_delay = init;
+	this->fail_alloc = init;
+	this->fail_host_done = init;
+	this->fail_delay_ms = 100;
+
+	fault_create_debugfs_attr("fail_irq", this->debugfs, &this->fail_irq);
+	fault_create_debugfs_attr("fail_delay", this->debugfs,
+				  &this->fail_delay);
+	debugfs_create_u32("fail_delay_ms", 0644, this->debugfs,
+			   &this->fail_delay_ms);
+	fault_create_debugfs_attr("fail_alloc", this->debugfs,
+				  &this->fail_alloc);
+	fault_create_debugfs_attr("fail_host_done", this->debugfs,
+				  &this->fail_host_done);
+#endif
+}
+
+/**
+ * pciep_debugfs_init() - Create the debugfs directory of a device.
+ * @this:	Pointer to the pciep driver data structure.
+ */
+static void pciep_debugfs_init(struct pciep_driver_data *this)
+{
+	this->debugfs = debugfs_create_dir(dev_name(this->sys_dev),
+					   pciep_debugfs_root);
+	debugfs_create_file("read_latency", 0444, this->debugfs,
+			    &this->read_path, &pciep_latency_fops);
+	debugfs_create_file("write_latency", 0444, this->debugfs,
+			    &this->write_path, &pciep_latency_fops);
+	debugfs_create_file("read_qos", 0444, this->debugfs,
+			    &this->read_path, &pciep_qos_fops);
+	debugfs_create_file("write_qos", 0444, this->debugfs,
+			    &this->write_path, &pciep_qos_fops);
+	pciep_fault_init(this);
+}
+
+#ifdef CONFIG_PCIEP_V4L2
+/**
+ * struct pciep_v4l2 - V4L2 capture front-end of the read path
+ * @this: device the front-end runs on
+ * @v4l2_dev: V4L2 device
+ * @vdev: capture video device
+ * @queue: vb2 queue of the capture buffers
+ * @lock: serializes the ioctls and the vb2 queue
+ * @stream: stream the capture transfers are queued for
+ * @queued_lock: protects @queued, @frames, @sequence and @file_len
+ * @queued: buffers handed to the read ring
+ * @frames: no.of frames queued since streaming started
+ * @sequence: no.of frames completed since streaming started
+ * @file_len: length of the host file, 0 for an endless stream
+ *
+ * The host stream is exposed as a single planar capture device. Its
+ * buffers are allocated by vb2 from the device the pool is placed on,
+ * or imported as dma-bufs, and go through the read ring like any other
+ * transfer, frame n being read at host offset n * sizeimage.
+ */
+struct pciep_v4l2 {
+	struct pciep_driver_data *this;
+	struct v4l2_device v4l2_dev;
+	struct video_device vdev;
+	struct vb2_queue queue;
+	struct mutex lock;
+	struct pciep_stream stream;
+	spinlock_t queued_lock;
+	struct list_head queued;
+	u32 frames;
+	u32 sequence;
+	u64 file_len;
+};
+
+/**
+ * struct pciep_v4l2_buffer - capture buffer
+ * @vb: vb2 buffer, must come first
+ * @xfer: transfer of the buffer on the read ring
+ * @list: entry in the queued list of the front-end
+ */
+struct pciep_v4l2_buffer {
+	struct vb2_v4l2_buffer vb;
+	struct pciep_buffer xfer;
+	struct list_head list;
+};
+
+static u32 pciep_v4l2_fourcc(u32 format)
+{
+	switch (format) {
+	case RAW_FORMAT_NV12:
+		return V4L2_PIX_FMT_NV12;
+	case RAW_FORMAT_NV16:
+		return V4L2_PIX_FMT_NV16;
+#ifdef V4L2_PIX_FMT_XV15
+	case RAW_FORMAT_XV15:
+		return V4L2_PIX_FMT_XV15;
+	case RAW_FORMAT_XV20:
+		return V4L2_PIX_FMT_XV20;
+#endif
+	default:
+		return 0;
+	}
+}
+
+static int pciep_v4l2_querycap(struct file *file, void *priv,
+			       struct v4l2_capability *cap)
+{
+	struct pciep_v4l2 *v4l2 = video_drvdata(file);
+
+	strscpy(cap->driver, DRIVER_NAME, sizeof(cap->driver));
+	strscpy(cap->card, v4l2->vdev.name, sizeof(cap->card));
+	snprintf(cap->bus_info, sizeof(cap->bus_info), "platform:%s",
+		 dev_name(v4l2->this->dma_dev));
+
+	return 0;
+}
+
+static int pciep_v4l2_enum_fmt(struct file *file, void *priv,
+			       struct v4l2_fmtdesc *f)
+{
+	struct pciep_v4l2 *v4l2 = video_drvdata(file);
+	struct stream_config config;
+
+	if (f->index)
+		return -EINVAL;
+
+	pciep_get_config(v4l2->this, &config);
+	f->pixelformat = pciep_v4l2_fourcc(config.format);
+
+	return f->pixelformat ? 0 : -EINVAL;
+}
+
+/* the host sets the format, G/S/TRY_FMT all report the host's */
+static int pciep_v4l2_fmt(struct file *file, void *priv,
+			  struct v4l2_format *f)
+{
+	struct pciep_v4l2 *v4l2 = video_drvdata(file);
+	struct v4l2_pix_format *pix = &f->fmt.pix;
+	struct stream_config config;
+
+	pciep_get_config(v4l2->this, &config);
+	pix->pixelformat = pciep_v4l2_fourcc(config.format);
+	if (!pix->pixelformat)
+		return -EINVAL;
+
+	pix->width = config.res.width;
+	pix->height = config.res.height;
+	pix->field = V4L2_FIELD_NONE;
+	pix->bytesperline = pciep_frame_stride(pix->width, config.format);
+	pix->sizeimage = pciep_frame_size(v4l2->this);
+	pix->colorspace = V4L2_COLORSPACE_REC709;
+
+	return 0;
+}
+
+static int pciep_v4l2_enum_input(struct file *file, void *priv,
+				 struct v4l2_input *input)
+{
+	if (input->index)
+		return -EINVAL;
+
+	input->type = V4L2_INPUT_TYPE_CAMERA;
+	strscpy(input->name, "PCIe host", sizeof(input->name));
+
+	return 0;
+}
+
+static int pciep_v4l2_g_input(struct file *file, void *priv,
+			      unsigned int *index)
+{
+	*index = 0;
+	return 0;
+}
+
+static int pciep_v4l2_s_input(struct file *file, void *priv,
+			      unsigned int index)
+{
+	return index ? -EINVAL : 0;
+}
+
+static int pciep_v4l2_g_parm(struct file *file, void *priv,
+			     struct v4l2_streamparm *parm)
+{
+	struct pciep_v4l2 *v4l2 = video_drvdata(file);
+	struct v4l2_fract *tpf = &parm->parm.capture.timeperframe;
+	struct stream_config config;
+
+	if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -EINVAL;
+
+	pciep_get_config(v4l2->this, &config);
+	parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+	parm->parm.capture.readbuffers = 0;
+	/* the host may not have configured the stream yet */
+	tpf->numerator = 1;
+	tpf->denominator = config.fps ?: 30;
+
+	return 0;
+}
+
+static const struct v4l2_ioctl_ops pciep_v4l2_ioctl_ops = {
+	.vidioc_querycap         = pciep_v4l2_querycap,
+	.vidioc_enum_fmt_vid_cap = pciep_v4l2_enum_fmt,
+	.vidioc_g_fmt_vid_cap    = pciep_v4l2_fmt,
+	.vidioc_s_fmt_vid_cap    = pciep_v4l2_fmt,
+	.vidioc_try_fmt_vid_cap  = pciep_v4l2_fmt,
+	.vidioc_enum_input       = pciep_v4l2_enum_input,
+	.vidioc_g_input          = pciep_v4l2_g_input,
+	.vidioc_s_input          = pciep_v4l2_s_input,
+	.vidioc_g_parm           = pciep_v4l2_g_parm,
+	.vidioc_s_parm           = pciep_v4l2_g_parm,
+	.vidioc_reqbufs          = vb2_ioctl_reqbufs,
+	.vidioc_create_bufs      = vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf      = vb2_ioctl_prepare_buf,
+	.vidioc_querybuf         = vb2_ioctl_querybuf,
+	.vidioc_qbuf             = vb2_ioctl_qbuf,
+	.vidioc_dqbuf            = vb2_ioctl_dqbuf,
+	.vidioc_expbuf           = vb2_ioctl_expbuf,
+	.vidioc_streamon         = vb2_ioctl_streamon,
+	.vidioc_streamoff        = vb2_ioctl_streamoff,
+};
+
+/*
+ * The video node counts as a user: a character device open or close must
+ * not reset the endpoint under a capture.
+ */
+static int pciep_v4l2_file_open(struct file *file)
+{
+	struct pciep_v4l2 *v4l2 = video_drvdata(file);
+	int ret;
+
+	ret = pciep_pm_get(v4l2->this);
+	if (ret)
+		return ret;
+	ret = v4l2_fh_open(file);
+	if (!ret)
+		pciep_users_get(v4l2->this);
+	pciep_pm_put(v4l2->this);
+
+	return ret;
+}
+
+static int pciep_v4l2_file_release(struct file *file)
+{
+	struct pciep_v4l2 *v4l2 = video_drvdata(file);
+	bool live = !pciep_op_begin(v4l2->this);
+	int ret;
+
+	/* like the char device's, goes ahead even if the resume failed */
+	if (live)
+		pm_runtime_get_sync(v4l2->this->dma_dev);
+	/* stops the capture if this file owns it */
+	ret = vb2_fop_release(file);
+	pciep_users_put(v4l2->this);
+	if (live)
+		pciep_pm_put(v4l2->this);
+
+	return ret;
+}
+
+/* queueing a buffer programs the read ring, like the char device ioctls */
+static long pciep_v4l2_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
+{
+	struct pciep_v4l2 *v4l2 = video_drvdata(file);
+	long ret;
+
+	ret = pciep_pm_get(v4l2->this);
+	if (ret)
+		return ret;
+	ret = video_ioctl2(file, cmd, arg);
+	pciep_pm_put(v4l2->this);
+
+	return ret;
+}
+
+static const struct v4l2_file_operations pciep_v4l2_fops = {
+	.owner          = THIS_MODULE,
+	.open           = pciep_v4l2_file_open,
+	.release        = pciep_v4l2_file_release,
+	.unlocked_ioctl = pciep_v4l2_ioctl,
+	.poll           = vb2_fop_poll,
+	.mmap           = vb2_fop_mmap,
+};
+
+static int pciep_v4l2_queue_setup(struct vb2_queue *q,
+				  unsigned int *num_buffers,
+				  unsigned int *num_planes,
+				  unsigned int sizes[],
+				  struct device *alloc_devs[])
+{
+	struct pciep_v4l2 *v4l2 = vb2_get_drv_priv(q);
+	u32 size = pciep_frame_size(v4l2->this);
+
+	if (!size)
+		return -EINVAL;
+
+	/* honour the buffer placement of the pool */
+	alloc_devs[0] = pciep_placement_dev(v4l2->this);
+	if (*num_planes)
+		return *num_planes != 1 || sizes[0] < size ? -EINVAL : 0;
+
+	*num_planes = 1;
+	sizes[0] = size;
+
+	return 0;
+}
+
+static int pciep_v4l2_buf_prepare(struct vb2_buffer *vb)
+{
+	struct pciep_v4l2 *v4l2 = vb2_get_drv_priv(vb->vb2_queue);
+	u32 size = pciep_frame_size(v4l2->this);
+
+	if (!size || vb2_plane_size(vb, 0) < size)
+		return -EINVAL;
+
+	vb2_set_plane_payload(vb, 0, size);
+
+	return 0;
+}
+
+/* called from the read interrupt thread with the path lock held */
+static void pciep_v4l2_complete(struct pciep_buffer *xfer)
+{
+	struct pciep_v4l2_buffer *buf = container_of(xfer,
+						     struct pciep_v4l2_buffer,
+						     xfer);
+	struct pciep_v4l2 *v4l2 = vb2_get_drv_priv(buf->vb.vb2_buf.vb2_queue);
+
+	spin_lock(&v4l2->queued_lock);
+	list_del(&buf->list);
+	buf->vb.sequence = v4l2->sequence++;
+	spin_unlock(&v4l2->queued_lock);
+
+	buf->vb.field = V4L2_FIELD_NONE;
+	buf->vb.vb2_buf.timestamp = ktime_to_ns(xfer->completed);
+	vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_DONE);
+}
+
+static void pciep_v4l2_buf_queue(struct vb2_buffer *vb)
+{
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+	struct pciep_v4l2_buffer *buf = container_of(vbuf,
+						     struct pciep_v4l2_buffer,
+						     vb);
+	struct pciep_v4l2 *v4l2 = vb2_get_drv_priv(vb->vb2_queue);
+	struct pciep_driver_data *this = v4l2->this;
+	size_t size = vb2_get_plane_payload(vb, 0);
+	struct pciep_buffer *xfer = &buf->xfer;
+	unsigned long flags;
+	u64 offset;
+
+	spin_lock_irqsave(&v4l2->queued_lock, flags);
+	if (!v4l2->frames)
+		v4l2->file_len = pciep_file_length(this);
+	offset = (u64)v4l2->frames * size;
+	if (v4l2->file_len && offset + size > v4l2->file_len) {
+		spin_unlock_irqrestore(&v4l2->queued_lock, flags);
+		/* past the end of the host file */
+		vbuf->flags |= V4L2_BUF_FLAG_LAST;
+		vb2_set_plane_payload(vb, 0, 0);
+		vb2_buffer_done(vb, VB2_BUF_STATE_DONE);
+		return;
+	}
+	v4l2->frames++;
+	list_add_tail(&buf->list, &v4l2->queued);
+	spin_unlock_irqrestore(&v4l2->queued_lock, flags);
+
+	memset(xfer, 0, sizeof(*xfer));
+	xfer->size = size;
+	xfer->state = PCIEP_BUF_USER;
+	xfer->phys_addr = vb2_dma_contig_plane_dma_addr(vb, 0);
+	xfer->complete = pciep_v4l2_complete;
+	pciep_path_queue(this, &this->read_path, xfer, &v4l2->stream, size,
+			 offset);
+}
+
+static void pciep_v4l2_stop_streaming(struct vb2_queue *q)
+{
+	struct pciep_v4l2 *v4l2 = vb2_get_drv_priv(q);
+	struct pciep_v4l2_buffer *buf, *tmp;
+	unsigned long flags;
+
+	/* nothing of the stream is left in the ring after the cancel */
+	pciep_path_cancel(v4l2->this, &v4l2->this->read_path, &v4l2->stream);
+
+	spin_lock_irqsave(&v4l2->queued_lock, flags);
+	list_for_each_entry_safe(buf, tmp, &v4l2->queued, list) {
+		list_del(&buf->list);
+		vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_ERROR);
+	}
+	v4l2->frames = 0;
+	v4l2->sequence = 0;
+	spin_unlock_irqrestore(&v4l2->queued_lock, flags);
+}
+
+static const struct vb2_ops pciep_v4l2_qops = {
+	.queue_setup    = pciep_v4l2_queue_setup,
+	.buf_prepare    = pciep_v4l2_buf_prepare,
+	.buf_queue      = pciep_v4l2_buf_queue,
+	.stop_streaming = pciep_v4l2_stop_streaming,
+	.wait_prepare   = vb2_ops_wait_prepare,
+	.wait_finish    = vb2_ops_wait_finish,
+};
+
+static void pciep_v4l2_release(struct video_device *vdev)
+{
+	struct pciep_v4l2 *v4l2 = container_of(vdev, struct pciep_v4l2, vdev);
+
+	v4l2_device_unregister(&v4l2->v4l2_dev);
+	pciep_put(v4l2->this);
+	kfree(v4l2);
+}
 
 /**
- * xilinx_pciep_read_irq_handler - Interrupt handler
- * @irq: IRQ number
- * @data: Pointer to the driver data structure
- *
- * Return: IRQ_HANDLED/IRQ_NONE
+ * pciep_v4l2_register() - Register the V4L2 capture front-end.
+ * @this:	Pointer to the pciep driver data structure.
+ * Return:      Success(=0) or error status(<0).
  */
-static irqreturn_t xilinx_pciep_read_irq_handler(int irq, void *data)
+static int pciep_v4l2_register(struct pciep_driver_data *this)
 {
-	struct pciep_driver_data *driver_data = data;
-	u32 value;
+	struct pciep_v4l2 *v4l2;
+	struct video_device *vdev;
+	struct vb2_queue *q;
+	int ret;
+
+	v4l2 = kzalloc(sizeof(*v4l2), GFP_KERNEL);
+	if (!v4l2)
+		return -ENOMEM;
 
-	value = reg_read(driver_data, PCIEP_READ_BUFFER_READY);
-	value &= ~SET_BUFFER_RDY;
-	reg_write(driver_data, PCIEP_READ_BUFFER_READY, value);
-	complete(&driver_data->read_complete);
-	reg_read(driver_data, PCIRC_READ_BUFFER_TRANSFER_DONE_INTR);
+	v4l2->this = this;
+	mutex_init(&v4l2->lock);
+	spin_lock_init(&v4l2->queued_lock);
+	INIT_LIST_HEAD(&v4l2->queued);
+	v4l2->stream.this = this;
+	v4l2->stream.qos_class = QOS_CLASS_NORMAL;
+	v4l2->stream.qos_weight = QOS_WEIGHT_DEFAULT;
+	mutex_init(&v4l2->stream.file_lock);
 
-	return IRQ_HANDLED;
+	ret = v4l2_device_register(this->dma_dev, &v4l2->v4l2_dev);
+	if (ret)
+		goto free;
+
+	q = &v4l2->queue;
+	q->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	q->io_modes = VB2_MMAP | VB2_DMABUF;
+	q->drv_priv = v4l2;
+	q->buf_struct_size = sizeof(struct pciep_v4l2_buffer);
+	q->ops = &pciep_v4l2_qops;
+	q->mem_ops = &vb2_dma_contig_memops;
+	q->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	q->lock = &v4l2->lock;
+	q->dev = this->dma_dev;
+	ret = vb2_queue_init(q);
+	if (ret)
+		goto unregister;
+
+	vdev = &v4l2->vdev;
+	snprintf(vdev->name, sizeof(vdev->name), DEVICE_NAME_FORMAT,
+		 pciep_minor(this));
+	vdev->fops = &pciep_v4l2_fops;
+	vdev->ioctl_ops = &pciep_v4l2_ioctl_ops;
+	vdev->release = pciep_v4l2_release;
+	vdev->v4l2_dev = &v4l2->v4l2_dev;
+	vdev->queue = q;
+	vdev->lock = &v4l2->lock;
+	vdev->vfl_dir = VFL_DIR_RX;
+	vdev->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+	video_set_drvdata(vdev, v4l2);
+
+	ret = video_register_device(vdev, VFL_TYPE_VIDEO, -1);
+	if (ret)
+		goto unregister;
+
+	/* the node may stay open past the removal, see pciep_get() */
+	pciep_get(this);
+	this->v4l2 = v4l2;
+	dev_info(this->sys_dev, "V4L2 capture on %s\n",
+		 video_device_node_name(vdev));
+
+	return 0;
+
+unregister:
+	v4l2_device_unregister(&v4l2->v4l2_dev);
+free:
+	kfree(v4l2);
+	return ret;
 }
 
 /**
- * xilinx_pciep_write_irq_handler - Interrupt handler
- * @irq: IRQ number
- * @data: Pointer to the driver data structure
+ * pciep_v4l2_unregister() - Remove the V4L2 capture front-end.
+ * @this:	Pointer to the pciep driver data structure.
  *
- * Return: IRQ_HANDLED/IRQ_NONE
+ * Streaming is stopped before the device goes, the structure itself is
+ * freed by the release callback once the last user closed the node.
  */
-static irqreturn_t xilinx_pciep_write_irq_handler(int irq, void *data)
+static void pciep_v4l2_unregister(struct pciep_driver_data *this)
 {
-	u32 value;
-	struct pciep_driver_data *driver_data = data;
-
-	value = reg_read(driver_data, PCIEP_WRITE_BUFFER_READY);
-	value &= ~SET_BUFFER_RDY;
-	reg_write(driver_data, PCIEP_WRITE_BUFFER_READY, value);
+	if (!this->v4l2)
+		return;
 
-	complete(&driver_data->write_complete);
-	reg_read(driver_data, PCIRC_WRITE_BUFFER_TRANSFER_DONE_INTR);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0)
+	vb2_video_unregister_device(&this->v4l2->vdev);
+#else
+	video_unregister_device(&this->v4l2->vdev);
+#endif
+	this->v4l2 = NULL;
+}
+#else
+static inline int pciep_v4l2_register(struct pciep_driver_data *this)
+{
+	return 0;
+}
 
-	return IRQ_HANDLED;
+static inline void pciep_v4l2_unregister(struct pciep_driver_data *this)
+{
 }
+#endif
 
 /**
- * xilinx_pciep_write_irq_handler - Interrupt handler
- * @irq: IRQ number
- * @data: Pointer to the driver data structure
+ * pciep_pl_dev_init() - Set up buffer allocation from PL DDR.
+ * @this:	Pointer to the pciep driver data structure.
+ * @parent:	Platform device carrying the DT properties.
  *
- * Return: IRQ_HANDLED/IRQ_NONE
+ * The "memory-region" of the device is attached to the class device,
+ * which then allocates from PL DDR while the platform device keeps
+ * allocating from the default CMA in PS DDR. Buffers are placed in PL
+ * DDR when such a region exists unless "xlnx,buffer-placement" is "ps".
  */
-static irqreturn_t xilinx_pciep_host_done_irq_handler(int irq, void *data)
+static void pciep_pl_dev_init(struct pciep_driver_data *this,
+			      struct device *parent)
 {
-	struct pciep_driver_data *driver_data = data;
+	struct device *dev = this->sys_dev;
+	const char *placement = NULL;
+	int ret;
 
-	reg_read(driver_data, PCIRC_HOST_DONE_INTR);
-	reg_write(driver_data, PCIEP_READ_TRANSFER_DONE, PCIEP_CLR_REG);
-	reg_write(driver_data, PCIEP_WRITE_TRANSFER_DONE, PCIEP_CLR_REG);
+	of_property_read_string(parent->of_node, "xlnx,buffer-placement",
+				&placement);
+	if (!of_property_read_bool(parent->of_node, "memory-region")) {
+		if (placement && !strcmp(placement, "pl"))
+			dev_warn(parent, "no memory-region for PL placement\n");
+		return;
+	}
 
-	return IRQ_HANDLED;
+	dev->coherent_dma_mask = this->dma_dev->coherent_dma_mask;
+	dev->dma_mask = &dev->coherent_dma_mask;
+	ret = of_reserved_mem_device_init_by_idx(dev, parent->of_node, 0);
+	if (ret) {
+		dev_warn(parent, "PL DDR region unavailable (%d)\n", ret);
+		return;
+	}
+
+	this->pl_dev = dev;
+	if (!placement || strcmp(placement, "ps"))
+		this->placement = BUF_PLACEMENT_PL;
 }
+
 /**
  * pciep_driver_create() -  Create pciep driver data structure.
  * @name:       device name   or NULL.
  * @parent:     parent device or NULL.
- * @minor:	minor_number.
- * @size:	buffer size.
+ * @size:	size of each pooled buffer.
+ * @num_bufs:	number of pooled buffers per direction.
  * @channel:    DMA channel name
  * Return:      Pointer to the pciep driver data structure or NULL.
  *
@@ -613,27 +6037,24 @@ static irqreturn_t xilinx_pciep_host_done_irq_handler(int irq, void *data)
  */
 static struct pciep_driver_data *pciep_driver_create(const char *name,
 						     struct device *parent,
-						     u32 minor, u32 size,
+						     u32 size, u32 num_bufs,
 						     char *channel)
 {
 	struct pciep_driver_data *this = NULL;
+	u32 addr_width = DEFAULT_ADDR_WIDTH;
+	const char *cache = NULL;
+	int minor;
 	const unsigned int DONE_ALLOC_MINOR   = (1 << 0);
 	const unsigned int DONE_CHRDEV_ADD    = (1 << 1);
 	const unsigned int DONE_ALLOC_CMA     = (1 << 2);
 	const unsigned int DONE_DEVICE_CREATE = (1 << 3);
 	unsigned int done = 0;
 
-	/* allocate device minor number */
-	if (minor < DEVICE_MAX_NUM) {
-		if (ida_simple_get(&pciep_device_ida, minor, minor+1,
-				   GFP_KERNEL) < 0) {
-			dev_err(parent, "couldn't allocate minor number(=%d)\n",
-				minor);
-			goto failed;
-		}
-	} else {
-		dev_err(parent, "invalid minor num(=%d),valid range: 0 to %d\n",
-			minor, DEVICE_MAX_NUM-1);
+	/* allocate device minor number, one per probed instance */
+	minor = ida_simple_get(&pciep_device_ida, 0, MAX_INSTANCES, GFP_KERNEL);
+	if (minor < 0) {
+		dev_err(parent, "couldn't allocate minor number, %d in use\n",
+			MAX_INSTANCES);
 		goto failed;
 	}
 	done |= DONE_ALLOC_MINOR;
@@ -643,12 +6064,26 @@ static struct pciep_driver_data *pciep_driver_create(const char *name,
 		goto failed;
 	/* make this->device_number and this->size */
 	this->device_number = MKDEV(MAJOR(pciep_device_number), minor);
-	this->size          = size;
+	this->size          = PAGE_ALIGN(size);
+	this->num_bufs      = num_bufs;
+	kref_init(&this->ref);
+	init_waitqueue_head(&this->ops_wait);
+	mutex_init(&this->lock);
+	mutex_init(&this->config_lock);
+	init_waitqueue_head(&this->config_wait);
+	INIT_WORK(&this->host_done_work, pciep_host_done_resume);
+	/* per-CPU counters, the hot paths only ever touch the local copy */
+	this->stats = alloc_percpu(struct pciep_stats);
+	if (!this->stats)
+		goto failed;
+	this->read_path.stats = &this->stats->read;
+	this->write_path.stats = &this->stats->write;
 	/* register /sys/class/ */
-	this->sys_dev = device_create(pciep_sys_class,
+	this->sys_dev = device_create_with_groups(pciep_sys_class,
 			parent,
 			this->device_number,
 			(void *)this,
+			pciep_groups,
 			DEVICE_NAME_FORMAT, MINOR(this->device_number));
 
 	if (IS_ERR_OR_NULL(this->sys_dev)) {
@@ -660,146 +6095,417 @@ static struct pciep_driver_data *pciep_driver_create(const char *name,
 	/* setup dma_dev */
 	this->dma_dev = parent;
 
+	/* "dma-coherent" endpoints behind the CCI get cached buffers anyway */
 	of_dma_configure(this->dma_dev, NULL, true);
-	dma_set_mask(this->dma_dev, DMA_BIT_MASK(sizeof(dma_addr_t) * 4));
-	dma_set_coherent_mask(this->dma_dev,
-			      DMA_BIT_MASK(sizeof(dma_addr_t) * 4));
+	this->coherent = of_dma_is_coherent(parent->of_node);
+	of_property_read_string(parent->of_node, "xlnx,buffer-cache", &cache);
+	if (cache && !strcmp(cache, "streaming"))
+		this->cache = BUF_CACHE_STREAMING;
+
+	/*
+	 * Buffer addresses are split over the address/address high register
+	 * pair, bitstreams without the high register set xlnx,addr-width
+	 * to 32 to keep their buffers in the low 4GB.
+	 */
+	of_property_read_u32(parent->of_node, "xlnx,addr-width", &addr_width);
+	if (addr_width < 32 || addr_width > 64)
+		addr_width = DEFAULT_ADDR_WIDTH;
+	if (dma_set_mask_and_coherent(this->dma_dev,
+				      DMA_BIT_MASK(addr_width))) {
+		dev_warn(parent, "%u-bit DMA unavailable, using 32-bit\n",
+			 addr_width);
+		dma_set_mask_and_coherent(this->dma_dev, DMA_BIT_MASK(32));
+	}
 
+	pciep_pl_dev_init(this, parent);
+
+	pciep_path_sched_init(&this->read_path);
+	pciep_path_sched_init(&this->write_path);
+	pciep_path_iocb_init(&this->read_path);
+	pciep_path_iocb_init(&this->write_path);
+
+	/* allocate the buffer pools once, they live as long as the device */
+	if (pciep_path_init(this, &this->read_path, "read",
+			    &pciep_read_regs))
+		goto failed;
+	if (pciep_path_init(this, &this->write_path, "write",
+			    &pciep_write_regs)) {
+		pciep_path_cleanup(this, &this->read_path);
+		goto failed;
+	}
 	done |= DONE_ALLOC_CMA;
 
 	/* add chrdev */
-	cdev_init(&this->cdev, &pciep_driver_file_ops);
-	this->cdev.owner = THIS_MODULE;
-	if (cdev_add(&this->cdev, this->device_number, MAX_INSTANCES) != 0) {
+	this->cdev = cdev_alloc();
+	if (!this->cdev)
+		goto failed;
+	this->cdev->ops = &pciep_driver_file_ops;
+	this->cdev->owner = THIS_MODULE;
+	mutex_lock(&pciep_devices_lock);
+	pciep_devices[minor] = this;
+	mutex_unlock(&pciep_devices_lock);
+	if (cdev_add(this->cdev, this->device_number, 1) != 0) {
 		dev_err(parent, "cdev_add() failed\n");
 		goto failed;
 	}
 	done |= DONE_CHRDEV_ADD;
 
+	pciep_debugfs_init(this);
+	/* both devices are used until the last reference, see pciep_put() */
+	get_device(this->sys_dev);
+	get_device(this->dma_dev);
+
 	dev_info(this->sys_dev, "major number   = %d\n",
 		 MAJOR(this->device_number));
 	dev_info(this->sys_dev, "minor number   = %d\n",
 		MINOR(this->device_number));
-	init_completion(&this->read_complete);
-	init_completion(&this->write_complete);
 
 	pr_err("pcie end point driver initialization success\n");
 	return this;
 failed:
-	if (done & DONE_CHRDEV_ADD)
-		cdev_del(&this->cdev);
+	if (this && this->cdev) {
+		mutex_lock(&pciep_devices_lock);
+		pciep_devices[minor] = NULL;
+		mutex_unlock(&pciep_devices_lock);
+		if (done & DONE_CHRDEV_ADD)
+			cdev_del(this->cdev);
+		else
+			kobject_put(&this->cdev->kobj);
+	}
+	if (done & DONE_ALLOC_CMA) {
+		pciep_path_cleanup(this, &this->write_path);
+		pciep_path_cleanup(this, &this->read_path);
+	}
+	if (this && this->pl_dev)
+		of_reserved_mem_device_release(this->pl_dev);
 	if (done & DONE_DEVICE_CREATE)
 		device_destroy(pciep_sys_class, this->device_number);
 	if (done & DONE_ALLOC_MINOR)
 		ida_simple_remove(&pciep_device_ida, minor);
-	if (this != NULL)
+	if (this != NULL) {
+		free_percpu(this->stats);
 		kfree(this);
+	}
 	return NULL;
 }
 
+/**
+ * pciep_driver_destroy() -  Remove the pciep driver data structure.
+ * @this:       Pointer to the pciep driver data structure.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * Unregister the device after releasing the resources. Open files, the
+ * V4L2 node, mappings and dma-bufs may outlive the removal: the device is
+ * marked dead, every transfer aborted and the entry points in progress
+ * waited for, the rest of the structure goes with the last reference.
+ */
+static int pciep_driver_destroy(struct pciep_driver_data *this)
+{
+	unsigned int minor;
+
+	if (!this)
+		return -ENODEV;
+
+	minor = MINOR(this->device_number);
+	mutex_lock(&pciep_devices_lock);
+	pciep_devices[minor] = NULL;
+	mutex_unlock(&pciep_devices_lock);
+	WRITE_ONCE(this->dead, true);
+	/* pairs with the barrier in pciep_op_begin() */
+	smp_mb();
+
+	cdev_del(this->cdev);
+	pciep_v4l2_unregister(this);
+	/* resumed by now, the line is not masked again once unmasked */
+	flush_work(&this->host_done_work);
+	/* the handlers use this, free them before it goes away */
+	if (this->host_done_irq) {
+		irq_set_affinity_hint(this->host_done_irq, NULL);
+		devm_free_irq(this->dma_dev, this->host_done_irq, this);
+	}
+	if (this->wr_irq) {
+		irq_set_affinity_hint(this->wr_irq, NULL);
+		devm_free_irq(this->dma_dev, this->wr_irq, this);
+	}
+	if (this->rd_irq) {
+		irq_set_affinity_hint(this->rd_irq, NULL);
+		devm_free_irq(this->dma_dev, this->rd_irq, this);
+	}
+
+	/* kick the blocked callers out, they see the device gone */
+	pciep_path_kill(this, &this->write_path);
+	pciep_path_kill(this, &this->read_path);
+	wake_up(&this->config_wait);
+	wait_event(this->ops_wait, !atomic_read(&this->ops));
+	pciep_path_quiesce(&this->write_path);
+	pciep_path_quiesce(&this->read_path);
+	/* the handshakes still pending go with the device */
+	if (test_and_clear_bit(0, &this->pm_handshake))
+		pm_runtime_put_noidle(this->dma_dev);
+	if (test_and_clear_bit(1, &this->pm_handshake))
+		pm_runtime_put_noidle(this->dma_dev);
+
+	debugfs_remove_recursive(this->debugfs);
+	device_destroy(pciep_sys_class, this->device_number);
+	ida_simple_remove(&pciep_device_ida, minor);
+	pciep_put(this);
+	return 0;
+}
+
+/**
+ * pciep_platform_request_irq() -  Map and request one interrupt.
+ * @pdev:	handle to the platform device structure.
+ * @this:	Pointer to the pciep driver data structure.
+ * @index:	index of the interrupt in the DT node.
+ * @handler:	hard interrupt handler, checks and acks the interrupt.
+ * @thread:	threaded handler doing the actual work.
+ * @name:	name of the interrupt.
+ * @irq:	set to the interrupt number on success.
+ * Return:      Success(=0) or error status(<0).
+ */
+static int pciep_platform_request_irq(struct platform_device *pdev,
+				      struct pciep_driver_data *this,
+				      int index, irq_handler_t handler,
+				      irq_handler_t thread, const char *name,
+				      int *irq)
+{
+	unsigned int virq;
+	int ret;
+
+	virq = irq_of_parse_and_map(pdev->dev.of_node, index);
+	if (!virq) {
+		dev_err(&pdev->dev, "Unable to get IRQ%d for pcie\n", index);
+		return -ENXIO;
+	}
+
+	ret = devm_request_threaded_irq(&pdev->dev, virq, handler, thread,
+					IRQF_SHARED, name, this);
+	if (ret < 0) {
+		dev_err(&pdev->dev, "Unable to register IRQ%d\n", index);
+		return ret;
+	}
+	*irq = virq;
+
+	return 0;
+}
+
+/**
+ * pciep_runtime_suspend() - Gate the register block once idle.
+ * @dev:	Platform device of the endpoint.
+ * Return:      Success(=0).
+ *
+ * The clock stays prepared, only enabling it is left for the resume,
+ * which keeps the first transfer after an idle period well under a
+ * frame time. Pools and register shadows are kept as they are.
+ */
+static int __maybe_unused pciep_runtime_suspend(struct device *dev)
+{
+	struct pciep_driver_data *this = dev_get_drvdata(dev);
+	ktime_t start = ktime_get();
+
+	/* keep the handlers of the shared lines off the registers */
+	WRITE_ONCE(this->suspended, true);
+	synchronize_irq(this->rd_irq);
+	synchronize_irq(this->wr_irq);
+	synchronize_irq(this->host_done_irq);
+	clk_disable(this->clk);
+
+	this_cpu_inc(this->stats->pm_suspends);
+	this_cpu_add(this->stats->pm_suspend_ns,
+		     ktime_to_ns(ktime_sub(ktime_get(), start)));
+	return 0;
+}
+
+/**
+ * pciep_runtime_resume() - Ungate the register block.
+ * @dev:	Platform device of the endpoint.
+ * Return:      Success(=0) or error status(<0).
+ *
+ * No transfer is in flight across a suspend, so the idle register state
+ * is restored from the shadows. The host done interrupt was not served
+ * while suspended, it is acked and handled here in case it fired, before
+ * pciep_host_done_resume() unmasks the line.
+ */
+static int __maybe_unused pciep_runtime_resume(struct device *dev)
+{
+	struct pciep_driver_data *this = dev_get_drvdata(dev);
+	ktime_t start = ktime_get();
+	u64 ns;
+	int ret;
+
+	ret = clk_enable(this->clk);
+	if (ret)
+		return ret;
+	pciep_path_restore_shadow(this, &this->read_path);
+	pciep_path_restore_shadow(this, &this->write_path);
+	WRITE_ONCE(this->suspended, false);
+	if (reg_read(this, PCIRC_HOST_DONE_INTR))
+		WRITE_ONCE(this->host_done_time, ktime_get());
+	pciep_host_done(this);
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	this_cpu_inc(this->stats->pm_resumes);
+	this_cpu_add(this->stats->pm_resume_ns, ns);
+	if (ns > this->pm_resume_max_ns)
+		WRITE_ONCE(this->pm_resume_max_ns, ns);
+	return 0;
+}
+
+static const struct dev_pm_ops pciep_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(pm_runtime_force_suspend,
+				pm_runtime_force_resume)
+	SET_RUNTIME_PM_OPS(pciep_runtime_suspend, pciep_runtime_resume, NULL)
+};
+
+/**
+ * pciep_pm_init() - Enable runtime PM of the endpoint.
+ * @this:	Pointer to the pciep driver data structure.
+ *
+ * The endpoint is active on probe and autosuspends after autosuspend_ms
+ * with no transfer in flight, no file operation in progress and no
+ * transfer done handshake pending, open files or not.
+ * power/autosuspend_delay_ms changes the delay afterwards. Without a
+ * clock there is nothing to gate and runtime PM is off until
+ * power/control allows it.
+ */
+static void pciep_pm_init(struct pciep_driver_data *this)
+{
+	struct device *dev = this->dma_dev;
+
+	pm_runtime_get_noresume(dev);
+	pm_runtime_set_active(dev);
+	pm_runtime_set_autosuspend_delay(dev, autosuspend_ms);
+	pm_runtime_use_autosuspend(dev);
+	if (!this->clk)
+		pm_runtime_forbid(dev);
+	pm_runtime_enable(dev);
+	__pciep_pm_put(this);
+}
+
+/**
+ * pciep_pm_exit() - Disable runtime PM of the endpoint.
+ * @this:	Pointer to the pciep driver data structure.
+ *
+ * The endpoint is left resumed for the teardown to access the registers.
+ */
+static void pciep_pm_exit(struct pciep_driver_data *this)
+{
+	struct device *dev = this->dma_dev;
+
+	pm_runtime_get_sync(dev);
+	pm_runtime_disable(dev);
+	if (!this->clk)
+		pm_runtime_allow(dev);
+	pm_runtime_dont_use_autosuspend(dev);
+	pm_runtime_put_noidle(dev);
+	pm_runtime_set_suspended(dev);
+}
+
 /**
  * pciep_platform_driver_probe() -  Probe call for the device.
  * @pdev:	handle to the platform device structure.
  * Return:      Success(=0) or error status(<0).
  *
  * It does all the memory allocation and registration for the device.
+ * Every reg-space instance in the DT gets its own minor number, buffer
+ * pools and interrupts.
  */
 static int pciep_platform_driver_probe(struct platform_device *pdev)
 {
 	int retval = 0;
-	u32 minor_number = 0;
 	struct pciep_driver_data *driver_data;
 	struct device_node *node = pdev->dev.of_node;
 	struct resource *res;
-	int status;
-	int ret;
-	u32 size=4096;
+	u32 size = DEFAULT_BUF_SIZE;
+	u32 count = DEFAULT_NUM_BUFS;
 	char channel[5];
 
+	/* pool geometry: module parameters override the DT properties */
+	of_property_read_u32(node, "xlnx,buffer-size", &size);
+	of_property_read_u32(node, "xlnx,num-buffers", &count);
+	if (buf_size)
+		size = buf_size;
+	if (num_bufs)
+		count = num_bufs;
+	if (!size || !count || count > MAX_NUM_BUFS) {
+		dev_err(&pdev->dev, "invalid pool %u x %u bytes\n",
+			count, size);
+		return -EINVAL;
+	}
+
 	/* create (pciep_driver_data*)this. */
-	driver_data = pciep_driver_create(DRIVER_NAME, &pdev->dev, minor_number,
-					  size, channel);
+	driver_data = pciep_driver_create(DRIVER_NAME, &pdev->dev, size, count,
+					  channel);
 	if (IS_ERR_OR_NULL(driver_data)) {
 		dev_err(&pdev->dev, "driver create fail.\n");
-		retval = PTR_ERR(driver_data);
+		retval = -ENODEV;
 		goto failed;
 	}
 
 	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-	driver_data->regs= devm_ioremap_resource(&pdev->dev, res);
-	if (IS_ERR_OR_NULL(driver_data->regs))
-		return PTR_ERR(driver_data->regs);
-
-	driver_data->rd_irq = irq_of_parse_and_map(node, 0);
-	if (driver_data->rd_irq < 0) {
-		pr_err("Unable to get IRQ for pcie");
-		return driver_data->rd_irq;
-	}
-
-	ret = devm_request_irq(&pdev->dev, driver_data->rd_irq,
-			       xilinx_pciep_read_irq_handler, IRQF_SHARED,
-			       "xilinx_pciep_read", driver_data);
-	if (ret < 0) {
-		dev_err(&pdev->dev, "Unable to register IRQ\n");
-		goto failed;
+	driver_data->regs = devm_ioremap_resource(&pdev->dev, res);
+	if (IS_ERR(driver_data->regs)) {
+		retval = PTR_ERR(driver_data->regs);
+		goto failed_destroy;
 	}
 
-	driver_data->wr_irq = irq_of_parse_and_map(node, 1);
-	if (driver_data->wr_irq < 0) {
-		pr_err("Unable to get IRQ1 for pcie");
-		return driver_data->wr_irq;
+	/* the register block runs off the DT clock, when there is one */
+	driver_data->clk = devm_clk_get_optional(&pdev->dev, NULL);
+	if (IS_ERR(driver_data->clk)) {
+		retval = PTR_ERR(driver_data->clk);
+		goto failed_destroy;
 	}
+	retval = clk_prepare_enable(driver_data->clk);
+	if (retval)
+		goto failed_destroy;
 
-	ret = devm_request_irq(&pdev->dev, driver_data->wr_irq,
-			       xilinx_pciep_write_irq_handler, IRQF_SHARED,
-			       "xilinx_pciep_write", driver_data);
-	if (ret < 0) {
-		dev_err(&pdev->dev, "Unable to register IRQ\n");
-		goto failed;
-	}
+	pciep_path_load_shadow(driver_data, &driver_data->read_path);
+	pciep_path_load_shadow(driver_data, &driver_data->write_path);
 
-	driver_data->host_done_irq = irq_of_parse_and_map(node, 2);
-	if (driver_data->host_done_irq < 0) {
-		pr_err("Unable to get IRQ1 for pcie");
-		return driver_data->host_done_irq;
-	}
+	retval = pciep_platform_request_irq(pdev, driver_data, 0,
+					    xilinx_pciep_read_irq_handler,
+					    xilinx_pciep_read_irq_thread,
+					    "xilinx_pciep_read",
+					    &driver_data->rd_irq);
+	if (retval)
+		goto failed_clk;
 
-	ret = devm_request_irq(&pdev->dev, driver_data->host_done_irq,
-			       xilinx_pciep_host_done_irq_handler, IRQF_SHARED,
-			       "xilinx_host_done", driver_data);
-	if (ret < 0) {
-		dev_err(&pdev->dev, "Unable to register IRQ\n");
-		goto failed;
-	}
+	retval = pciep_platform_request_irq(pdev, driver_data, 1,
+					    xilinx_pciep_write_irq_handler,
+					    xilinx_pciep_write_irq_thread,
+					    "xilinx_pciep_write",
+					    &driver_data->wr_irq);
+	if (retval)
+		goto failed_clk;
 
+	retval = pciep_platform_request_irq(pdev, driver_data, 2,
+					    xilinx_pciep_host_done_irq_handler,
+					    xilinx_pciep_host_done_irq_thread,
+					    "xilinx_host_done",
+					    &driver_data->host_done_irq);
+	if (retval)
+		goto failed_clk;
 
 	dev_set_drvdata(&pdev->dev, driver_data);
+	pciep_pm_init(driver_data);
+
+	/* the V4L2 front-end is optional, the char device works without */
+	retval = pciep_v4l2_register(driver_data);
+	if (retval)
+		dev_warn(&pdev->dev, "V4L2 front-end unavailable: %d\n", retval);
+
 	dev_info(&pdev->dev, "pcie driver probe success.\n");
 	return 0;
 
+failed_clk:
+	clk_disable_unprepare(driver_data->clk);
+failed_destroy:
+	pciep_driver_destroy(driver_data);
 failed:
 	dev_info(&pdev->dev, "driver install failed.\n");
 	return retval;
 }
 
-/**
- * pciep_driver_destroy() -  Remove the pciep driver data structure.
- * @this:       Pointer to the pciep driver data structure.
- * Return:      Success(=0) or error status(<0).
- *
- * Unregister the device after releasing the resources.
- */
-static int pciep_driver_destroy(struct pciep_driver_data *this)
-{
-	if (!this)
-		return -ENODEV;
-
-	ida_simple_remove(&pciep_device_ida, MINOR(this->device_number));
-	cdev_del(&this->cdev);
-	kfree(this);
-	return 0;
-}
-
 /**
  * pciep_platform_driver_remove() -  Remove call for the device.
  * @pdev:	Handle to the platform device structure.
@@ -810,11 +6516,18 @@ static int pciep_driver_destroy(struct pciep_driver_data *this)
 static int pciep_platform_driver_remove(struct platform_device *pdev)
 {
 	struct pciep_driver_data *this = dev_get_drvdata(&pdev->dev);
+	struct clk *clk;
 	int retval = 0;
 
+	if (!this)
+		return -ENODEV;
+	pciep_pm_exit(this);
+	clk = this->clk;
+
 	retval = pciep_driver_destroy(this);
 	if (retval != 0)
 		return retval;
+	clk_disable_unprepare(clk);
 	dev_set_drvdata(&pdev->dev, NULL);
 	return 0;
 }
@@ -838,6 +6551,7 @@ static struct platform_driver pciep_platform_driver = {
 		.owner = THIS_MODULE,
 		.name  = DRIVER_NAME,
 		.of_match_table = pciep_of_match,
+		.pm    = &pciep_pm_ops,
 	},
 };
 
@@ -850,8 +6564,11 @@ static void pciep_module_exit(void)
 
 	if (pciep_platform_driver_done)
 		platform_driver_unregister(&pciep_platform_driver);
+	if (pciep_sys_class)
+		class_destroy(pciep_sys_class);
 	if (pciep_device_number != 0)
-		unregister_chrdev_region(pciep_device_number, 0);
+		unregister_chrdev_region(pciep_device_number, MAX_INSTANCES);
+	debugfs_remove_recursive(pciep_debugfs_root);
 	ida_destroy(&pciep_device_ida);
 }
 
@@ -878,6 +6595,7 @@ static int __init pciep_module_init(void)
 		pciep_sys_class = NULL;
 		goto failed;
 	}
+	pciep_debugfs_root = debugfs_create_dir(DRIVER_NAME, NULL);
 	retval = platform_driver_register(&pciep_platform_driver);
 	if (retval)
 		pr_err("%s: couldn't register platform driver\n", DRIVER_NAME);
@@ -895,3 +6613,6 @@ module_exit(pciep_module_exit);
 MODULE_AUTHOR("Xilinx, Inc.");
 MODULE_DESCRIPTION("PCIe usersapce register device driver");
 MODULE_LICENSE("GPL v2");
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
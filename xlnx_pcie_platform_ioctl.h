@@ -0,0 +1,227 @@
+/*
+* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note
+*
+* PL MEM Mapping driver user interface
+*
+* Description:
+* ioctl numbers and argument layouts of the /dev/pciepN devices, shared
+* by the driver and the applications driving it.
+*
+* Copyright (C) 2021 Xilinx, Inc.
+*/
+
+#ifndef _XLNX_PCIE_PLATFORM_IOCTL_H
+#define _XLNX_PCIE_PLATFORM_IOCTL_H
+
+#include <linux/types.h>
+#ifndef __KERNEL__
+#include <stdbool.h>
+#endif
+
+#define GET_FILE_LENGTH                         0x0
+#define GET_ENC_PARAMS                          0x1
+#define SET_READ_OFFSET                         0x2
+#define SET_WRITE_OFFSET                        0x3
+#define SET_READ_TRANSFER_DONE                  0x5
+#define CLR_READ_TRANSFER_DONE                  0x6
+#define SET_WRITE_TRANSFER_DONE                 0x7
+#define CLR_WRITE_TRANSFER_DONE                 0x8
+#define GET_RESOLUTION                          0x9
+#define GET_MODE                                0xa
+#define GET_FPS                                 0xb
+#define GET_FORMAT                              0xc
+#define QUERY_BUF                               0xd
+#define QUEUE_BUF                               0xe
+#define DEQUEUE_BUF                             0xf
+#define EXPORT_BUF                              0x10
+#define IMPORT_BUF                              0x11
+#define UNIMPORT_BUF                            0x12
+#define SET_BUF_PLACEMENT                       0x13
+#define GET_BUF_PLACEMENT                       0x14
+#define SET_IRQ_AFFINITY                        0x15
+#define GET_STREAM_CONFIG                       0x16
+#define SET_TRANSFER_TIMEOUT                    0x17
+#define CANCEL_TRANSFERS                        0x18
+#define START_FILE_STREAM                       0x19
+#define STOP_FILE_STREAM                        0x1a
+#define START_PIPELINE                          0x1b
+#define STOP_PIPELINE                           0x1c
+#define SET_BUF_CACHE                           0x1d
+#define GET_BUF_CACHE                           0x1e
+#define SYNC_BUF                                0x1f
+#define SET_STREAM_QOS                          0x20
+#define GET_STREAM_QOS                          0x21
+
+#define BUF_TYPE_READ                           0x0
+#define BUF_TYPE_WRITE                          0x1
+#define BUF_TYPE_ALL                            0xFFFFFFFF
+
+#define BUF_MEMORY_MMAP                         0x0
+#define BUF_MEMORY_DMABUF                       0x1
+
+#define BUF_PLACEMENT_PS                        0x0
+#define BUF_PLACEMENT_PL                        0x1
+
+/*
+ * UNCACHED pool buffers are mapped uncached unless the device is
+ * dma-coherent, STREAMING ones are cached and handed over with SYNC_BUF.
+ * GET_BUF_CACHE reports COHERENT when the device snoops the CPU caches,
+ * SYNC_BUF is then not needed either way.
+ */
+#define BUF_CACHE_UNCACHED                      0x0
+#define BUF_CACHE_STREAMING                     0x1
+#define BUF_CACHE_COHERENT                      0x2
+
+#define SYNC_BUF_START                          0x1
+#define SYNC_BUF_END                            0x2
+
+#define IRQ_AFFINITY_NONE                       0xFFFFFFFF
+
+/*
+ * QoS classes of SET_STREAM_QOS, most urgent first. A class is served
+ * only while nothing of a more urgent one waits, the streams of a class
+ * share the endpoint in proportion to their weights. REALTIME suits the
+ * live low delay encode, BULK file transfers.
+ */
+#define QOS_CLASS_REALTIME                      0x0
+#define QOS_CLASS_NORMAL                        0x1
+#define QOS_CLASS_BULK                          0x2
+
+#define QOS_WEIGHT_DEFAULT                      100
+#define QOS_WEIGHT_MAX                          10000
+
+#define STREAM_CONFIG_VERSION                   0x1
+
+/* GET_FORMAT values of the raw video formats */
+#define RAW_FORMAT_NV12                         0x0
+#define RAW_FORMAT_NV16                         0x1
+#define RAW_FORMAT_XV15                         0x2
+#define RAW_FORMAT_XV20                         0x3
+
+/**
+ * struct buffer_desc - QUERY_BUF/QUEUE_BUF/DEQUEUE_BUF argument
+ * @type: BUF_TYPE_READ or BUF_TYPE_WRITE
+ * @index: index of the pool buffer, or of the import for BUF_MEMORY_DMABUF
+ * @length: size of the buffer, filled by QUERY_BUF and IMPORT_BUF
+ * @offset: mmap() offset of the buffer, filled by QUERY_BUF
+ * @bytesused: no.of bytes to transfer on QUEUE_BUF (0: whole buffer),
+ *	no.of bytes transferred on DEQUEUE_BUF
+ * @memory: BUF_MEMORY_MMAP for pool buffers, BUF_MEMORY_DMABUF for imports
+ * @fd: dma-buf fd returned by EXPORT_BUF or passed to IMPORT_BUF
+ * @timestamp: CLOCK_MONOTONIC time in ns the transfer done interrupt
+ *	fired, filled by DEQUEUE_BUF
+ * @host_timestamp: CLOCK_MONOTONIC time in ns of the last host done
+ *	interrupt while the transfer was in flight, 0 if there was none,
+ *	filled by DEQUEUE_BUF
+ */
+typedef struct buffer_desc {
+	__u32 type;
+	__u32 index;
+	__u64 length;
+	__u64 offset;
+	__u64 bytesused;
+	__u32 memory;
+	__s32 fd;
+	__u64 timestamp;
+	__u64 host_timestamp;
+} buffer_desc;
+
+typedef struct enc_params {
+	bool enable_l2Cache;
+	bool low_bandwidth;
+	bool filler_data;
+	bool max_picture_size;
+	unsigned int bitrate;
+	unsigned int gop_len;
+	unsigned int b_frame;
+	unsigned int slice;
+	unsigned int qp_mode;
+	unsigned int rc_mode;
+	unsigned int enc_type;
+	unsigned int gop_mode;
+	unsigned int profile;
+	unsigned int min_qp;
+	unsigned int max_qp;
+	unsigned int cpb_size;
+	unsigned int initial_delay;
+	unsigned int periodicity_idr;
+} enc_params;
+
+typedef struct resolution {
+	unsigned int width;
+	unsigned int height;
+} resolution;
+
+/**
+ * struct stream_config - GET_STREAM_CONFIG argument
+ * @version: STREAM_CONFIG_VERSION, layout of the rest of the struct
+ * @generation: bumped every time the host changes the configuration
+ * @params: same as GET_ENC_PARAMS
+ * @res: same as GET_RESOLUTION
+ * @mode: same as GET_MODE
+ * @fps: same as GET_FPS
+ * @format: same as GET_FORMAT
+ * @reserved: zero
+ */
+typedef struct stream_config {
+	__u32 version;
+	__u32 generation;
+	struct enc_params params;
+	struct resolution res;
+	__u32 mode;
+	__u32 fps;
+	__u32 format;
+	__u32 reserved;
+} stream_config;
+
+/**
+ * struct buffer_sync - SYNC_BUF argument
+ * @type: BUF_TYPE_READ or BUF_TYPE_WRITE
+ * @index: index of the pool buffer
+ * @flags: SYNC_BUF_START before the CPU accesses the buffer, SYNC_BUF_END
+ *	once it is done and before the buffer is queued again
+ * @reserved: must be zero
+ * @offset: start of the accessed range in the buffer
+ * @length: size of the accessed range, 0: up to the end of the buffer
+ */
+typedef struct buffer_sync {
+	__u32 type;
+	__u32 index;
+	__u32 flags;
+	__u32 reserved;
+	__u64 offset;
+	__u64 length;
+} buffer_sync;
+
+/**
+ * struct stream_qos - SET_STREAM_QOS/GET_STREAM_QOS argument
+ * @prio_class: QOS_CLASS_*, QOS_CLASS_REALTIME needs CAP_SYS_NICE
+ * @weight: share of the stream within its class, up to QOS_WEIGHT_MAX,
+ *	0: QOS_WEIGHT_DEFAULT
+ * @max_rate: cap of each direction of the stream in bytes/s, 0: none
+ * @reserved: must be zero
+ */
+typedef struct stream_qos {
+	__u32 prio_class;
+	__u32 weight;
+	__u64 max_rate;
+	__u64 reserved;
+} stream_qos;
+
+/**
+ * struct pipeline_config - START_PIPELINE argument
+ * @frame_size: size of a raw frame in bytes, 0: derived from GET_RESOLUTION
+ *	and GET_FORMAT, filled on return
+ * @frames: no.of raw frames to read, 0: as many as GET_FILE_LENGTH holds,
+ *	filled on return
+ * @mode: use case mode the pipeline was started in, filled on return
+ * @reserved: must be zero
+ */
+typedef struct pipeline_config {
+	__u32 frame_size;
+	__u32 frames;
+	__u32 mode;
+	__u32 reserved;
+} pipeline_config;
+
+#endif /* _XLNX_PCIE_PLATFORM_IOCTL_H */
@@ -0,0 +1,163 @@
+/*
+* SPDX-License-Identifier: GPL-2.0
+*
+* PL MEM Mapping driver tracepoints
+*
+* Description:
+* Transfer life cycle events of the PCIe endpoint driver, for use with
+* perf, ftrace or LTTng. Every event carries the minor number of the
+* device and the direction of the transfer.
+*
+* Copyright (C) 2021 Xilinx, Inc.
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pciep
+
+#if !defined(_XLNX_PCIE_PLATFORM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _XLNX_PCIE_PLATFORM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define pciep_show_dir(write)	((write) ? "write" : "read")
+
+TRACE_EVENT(pciep_buffer_get,
+	TP_PROTO(unsigned int minor, bool write, bool pooled,
+		 unsigned int index, size_t size),
+	TP_ARGS(minor, write, pooled, index, size),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(bool, write)
+		__field(bool, pooled)
+		__field(unsigned int, index)
+		__field(size_t, size)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->write = write;
+		__entry->pooled = pooled;
+		__entry->index = index;
+		__entry->size = size;
+	),
+	TP_printk("pciep%u %s %s buffer %u size %zu", __entry->minor,
+		  pciep_show_dir(__entry->write),
+		  __entry->pooled ? "pool" : "one-off", __entry->index,
+		  __entry->size)
+);
+
+DECLARE_EVENT_CLASS(pciep_transfer,
+	TP_PROTO(unsigned int minor, bool write, u64 addr, u32 size,
+		 u64 offset),
+	TP_ARGS(minor, write, addr, size, offset),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(bool, write)
+		__field(u64, addr)
+		__field(u32, size)
+		__field(u64, offset)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->write = write;
+		__entry->addr = addr;
+		__entry->size = size;
+		__entry->offset = offset;
+	),
+	TP_printk("pciep%u %s addr 0x%llx size %u offset 0x%llx",
+		  __entry->minor, pciep_show_dir(__entry->write),
+		  __entry->addr, __entry->size, __entry->offset)
+);
+
+/* buffer programmed and the buffer ready flag set */
+DEFINE_EVENT(pciep_transfer, pciep_buffer_ready,
+	TP_PROTO(unsigned int minor, bool write, u64 addr, u32 size,
+		 u64 offset),
+	TP_ARGS(minor, write, addr, size, offset)
+);
+
+/* active buffer retired by the transfer done interrupt */
+DEFINE_EVENT(pciep_transfer, pciep_transfer_done,
+	TP_PROTO(unsigned int minor, bool write, u64 addr, u32 size,
+		 u64 offset),
+	TP_ARGS(minor, write, addr, size, offset)
+);
+
+/* queued or active buffer taken back before the host completed it */
+DEFINE_EVENT(pciep_transfer, pciep_transfer_abort,
+	TP_PROTO(unsigned int minor, bool write, u64 addr, u32 size,
+		 u64 offset),
+	TP_ARGS(minor, write, addr, size, offset)
+);
+
+TRACE_EVENT(pciep_irq,
+	TP_PROTO(unsigned int minor, bool write),
+	TP_ARGS(minor, write),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(bool, write)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->write = write;
+	),
+	TP_printk("pciep%u %s", __entry->minor,
+		  pciep_show_dir(__entry->write))
+);
+
+TRACE_EVENT(pciep_host_done,
+	TP_PROTO(unsigned int minor),
+	TP_ARGS(minor),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+	),
+	TP_printk("pciep%u", __entry->minor)
+);
+
+/* copy_to_user() of a read or copy_from_user() of a write finished */
+TRACE_EVENT(pciep_copy_done,
+	TP_PROTO(unsigned int minor, bool write, size_t count, int ret),
+	TP_ARGS(minor, write, count, ret),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(bool, write)
+		__field(size_t, count)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->write = write;
+		__entry->count = count;
+		__entry->ret = ret;
+	),
+	TP_printk("pciep%u %s count %zu not copied %d", __entry->minor,
+		  pciep_show_dir(__entry->write), __entry->count,
+		  __entry->ret)
+);
+
+TRACE_EVENT(pciep_set_offset,
+	TP_PROTO(unsigned int minor, bool write, u64 offset),
+	TP_ARGS(minor, write, offset),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(bool, write)
+		__field(u64, offset)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->write = write;
+		__entry->offset = offset;
+	),
+	TP_printk("pciep%u %s offset 0x%llx", __entry->minor,
+		  pciep_show_dir(__entry->write), __entry->offset)
+);
+
+#endif /* _XLNX_PCIE_PLATFORM_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE xlnx_pcie_platform_trace
+#include <trace/define_trace.h>